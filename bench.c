@@ -0,0 +1,412 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark for the init, glob and magic code paths. All input is
+ * generated from a seeded PRNG, so runs with the same seed on the same
+ * MIME database are comparable. The results are written as JSON to
+ * stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "dsbmime.h"
+#include "glob.h"
+#include "magic.h"
+
+#define DEFAULT_NAMES	1000000
+#define DEFAULT_SEED	1
+#define INIT_RUNS	10
+#define MAGIC_PASSES	20
+#define SAMPLE_SIZE	8192
+
+typedef struct ext_s {
+	const char *ext;
+	int	   weight;
+} ext_t;
+
+/*
+ * Rough distribution of file name extensions found on a typical file
+ * server or build host.
+ */
+static ext_t exts[] = {
+	{ "jpg",     140 }, { "png",	 80 }, { "js",	     60 },
+	{ "txt",      60 }, { "html",	 50 }, { "log",	     30 },
+	{ "c",	      40 }, { "h",	 40 }, { "py",	     40 },
+	{ "pdf",      40 }, { "json",	 40 }, { "xml",	     30 },
+	{ "tar.gz",   30 }, { "mp3",	 30 }, { "css",	     30 },
+	{ "md",	      30 }, { "gif",	 20 }, { "svg",	     20 },
+	{ "zip",      20 }, { "docx",	 20 }, { "mp4",	     20 },
+	{ "sh",	      20 }, { "o",	 20 }, { "cpp",	     20 },
+	{ "java",     20 }, { "csv",	 20 }, { "xlsx",     10 },
+	{ "go",	      10 }, { "rs",	 10 }, { "odt",	     10 },
+	{ "wav",      10 }, { "deb",	 10 }, { "iso",	      5 },
+	{ "epub",      5 }, { "ttf",	  5 }, { "tiff",      5 },
+	{ "rpm",       5 }, { "bz2",	  5 }, { "xz",	      5 },
+	{ "7z",	       5 }, { "mkv",	  5 }, { "webp",      5 }
+};
+#define NEXTS (sizeof(exts) / sizeof(exts[0]))
+
+typedef enum {
+	NAME_HIT, NAME_MISS, NAME_FOLDED
+} name_kind_t;
+
+typedef struct job_s {
+	int  from, to, passes;
+	bool magic;		/* Magic or glob lookups */
+	char **names;
+} job_t;
+
+static int	total_weight;
+static uint64_t rng_state;
+
+static uint64_t
+rng(void)
+{
+	uint64_t z;
+
+	/* splitmix64 */
+	z = (rng_state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+usage(void)
+{
+	(void)fprintf(stderr,
+	    "Usage: bench [-n names] [-s seed] [-t max threads]\n");
+	exit(EXIT_FAILURE);
+}
+
+static char *
+gen_name(name_kind_t kind)
+{
+	int	   i, len, w;
+	char	   *name, *p;
+	const char *ext;
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789_-";
+
+	if ((name = malloc(32)) == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	len = 3 + rng() % 10;
+	for (i = 0; i < len; i++)
+		name[i] = chars[rng() % (sizeof(chars) - 1)];
+	name[i++] = '.';
+	if (kind == NAME_MISS) {
+		/* Extensions made of digits and 'q' are unknown. */
+		for (len = 3 + rng() % 3; len > 0; len--)
+			name[i++] = "0123456789q"[rng() % 11];
+		name[i] = '\0';
+		return (name);
+	}
+	for (ext = exts[0].ext, w = rng() % total_weight, i = 0;
+	    i < NEXTS; i++) {
+		if ((w -= exts[i].weight) < 0) {
+			ext = exts[i].ext;
+			break;
+		}
+	}
+	(void)strcpy(name + len + 1, ext);
+	if (kind == NAME_FOLDED) {
+		for (p = name + len + 1; *p != '\0'; p++)
+			*p = toupper((unsigned char)*p);
+	}
+	return (name);
+}
+
+static char **
+gen_names(int n, name_kind_t kind)
+{
+	int  i;
+	char **names;
+
+	if ((names = malloc(n * sizeof(char *))) == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	for (i = 0; i < n; i++)
+		names[i] = gen_name(kind);
+	return (names);
+}
+
+static void
+free_names(char **names, int n)
+{
+	while (n-- > 0)
+		free(names[n]);
+	free(names);
+}
+
+/*
+ * Do what dsbmime_get_type() does before it falls back to the magic
+ * stage.
+ */
+static const char *
+glob_lookup(const char *name)
+{
+	const char *mime;
+
+	if ((mime = glob_lookup_mime_type(name, false, NULL)) == NULL)
+		mime = glob_lookup_mime_type(name, true, NULL);
+	return (mime);
+}
+
+static double
+time_glob(char **names, int n)
+{
+	int    i;
+	double t;
+
+	for (t = now(), i = 0; i < n; i++)
+		(void)glob_lookup(names[i]);
+	return ((now() - t) * 1e9 / n);
+}
+
+static double
+time_init(void)
+{
+	int    i;
+	double t;
+
+	for (t = now(), i = 0; i < INIT_RUNS; i++) {
+		if (dsbmime_init() == -1)
+			errx(EXIT_FAILURE, "Couldn't init mime lib");
+		if (i < INIT_RUNS - 1)
+			dsbmime_cleanup();
+	}
+	return ((now() - t) * 1e3 / INIT_RUNS);
+}
+
+/*
+ * Create one file per magic section in dir, whose header satisfies
+ * the section's rules.
+ */
+static char **
+gen_corpus(const char *dir, int *n)
+{
+	int	   i, fd;
+	char	   **paths;
+	u_char	   *buf;
+	ssize_t	   len;
+	const char *type;
+
+	*n = magic_nsections();
+	if ((paths = malloc(*n * sizeof(char *))) == NULL ||
+	    (buf = malloc(SAMPLE_SIZE)) == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	for (i = 0; i < *n; i++) {
+		if ((len = magic_gen_sample(i, buf, SAMPLE_SIZE, &type)) < 0)
+			errx(EXIT_FAILURE, "magic_gen_sample() failed");
+		/* Some padding, so that range searches run to the end. */
+		len += 64;
+		if ((paths[i] = malloc(strlen(dir) + 16)) == NULL)
+			err(EXIT_FAILURE, "malloc()");
+		(void)sprintf(paths[i], "%s/s%05d", dir, i);
+		if ((fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC,
+		    0644)) == -1)
+			err(EXIT_FAILURE, "open(%s)", paths[i]);
+		if (write(fd, buf, len) != len)
+			err(EXIT_FAILURE, "write(%s)", paths[i]);
+		(void)close(fd);
+	}
+	free(buf);
+	return (paths);
+}
+
+static void
+rm_corpus(const char *dir, char **paths, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		(void)unlink(paths[i]);
+	free_names(paths, n);
+	(void)rmdir(dir);
+}
+
+static void *
+run_job(void *arg)
+{
+	int   i, pass;
+	job_t *job = arg;
+
+	for (pass = 0; pass < job->passes; pass++) {
+		for (i = job->from; i < job->to; i++) {
+			if (job->magic)
+				(void)magic_lookup_mime_type(job->names[i]);
+			else
+				(void)glob_lookup(job->names[i]);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Split the given names into nthreads equal parts, and return the
+ * number of lookups per second.
+ */
+static double
+time_threads(bool magic, char **names, int n, int passes, int nthreads)
+{
+	int	  i;
+	job_t	  *jobs;
+	double	  t;
+	pthread_t *tids;
+
+	if ((jobs = malloc(nthreads * sizeof(job_t))) == NULL ||
+	    (tids = malloc(nthreads * sizeof(pthread_t))) == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	t = now();
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].from   = (int)((long)n * i / nthreads);
+		jobs[i].to     = (int)((long)n * (i + 1) / nthreads);
+		jobs[i].names  = names;
+		jobs[i].magic  = magic;
+		jobs[i].passes = passes;
+		if (pthread_create(&tids[i], NULL, run_job, &jobs[i]) != 0)
+			errx(EXIT_FAILURE, "pthread_create() failed");
+	}
+	for (i = 0; i < nthreads; i++)
+		(void)pthread_join(tids[i], NULL);
+	t = now() - t;
+	free(jobs); free(tids);
+
+	return ((double)n * passes / t);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int		ch, i, n, ncorpus, maxthreads, have_stats;
+	char		**hits, **misses, **folded, **corpus, dir[64];
+	double		init_ms, hit_ns, miss_ns, folded_ns, t, rate;
+	uint64_t	seed;
+	dsbmime_stats_t st;
+
+	n = DEFAULT_NAMES; seed = DEFAULT_SEED;
+	if ((maxthreads = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		maxthreads = 1;
+	while ((ch = getopt(argc, argv, "n:s:t:h")) != -1) {
+		switch (ch) {
+		case 'n':
+			if ((n = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			if ((maxthreads = atoi(optarg)) < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	rng_state = seed;
+	for (i = 0, total_weight = 0; i < NEXTS; i++)
+		total_weight += exts[i].weight;
+	init_ms = time_init();
+
+	hits   = gen_names(n, NAME_HIT);
+	misses = gen_names(n, NAME_MISS);
+	folded = gen_names(n, NAME_FOLDED);
+	hit_ns	  = time_glob(hits, n);
+	miss_ns	  = time_glob(misses, n);
+	folded_ns = time_glob(folded, n);
+
+	(void)snprintf(dir, sizeof(dir), "%s/dsbmime-bench.XXXXXX",
+	    getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp");
+	if (mkdtemp(dir) == NULL)
+		err(EXIT_FAILURE, "mkdtemp(%s)", dir);
+	corpus = gen_corpus(dir, &ncorpus);
+	dsbmime_reset_stats();
+	t = now();
+	for (i = 0; i < ncorpus; i++)
+		(void)magic_lookup_mime_type(corpus[i]);
+	t = now() - t;
+	have_stats = dsbmime_get_stats(&st) == 0 && st.magic_opens > 0;
+
+	(void)printf("{\n");
+	(void)printf("  \"seed\": %llu,\n", (unsigned long long)seed);
+	(void)printf("  \"names\": %d,\n", n);
+	(void)printf("  \"init_ms\": %.3f,\n", init_ms);
+	(void)printf("  \"glob\": {\n");
+	(void)printf("    \"hit_ns\": %.1f,\n", hit_ns);
+	(void)printf("    \"miss_ns\": %.1f,\n", miss_ns);
+	(void)printf("    \"folded_ns\": %.1f\n", folded_ns);
+	(void)printf("  },\n");
+	(void)printf("  \"magic\": {\n");
+	(void)printf("    \"files\": %d,\n", ncorpus);
+	(void)printf("    \"lookups_per_sec\": %.1f,\n", ncorpus / t);
+	if (have_stats) {
+		(void)printf("    \"bytes_per_file\": %.1f,\n",
+		    (double)st.magic_bytes / st.magic_opens);
+		(void)printf("    \"sections_per_file\": %.1f\n",
+		    (double)st.magic_sections / st.magic_opens);
+	} else {
+		(void)printf("    \"bytes_per_file\": null,\n");
+		(void)printf("    \"sections_per_file\": null\n");
+	}
+	(void)printf("  },\n");
+	(void)printf("  \"scaling\": [\n");
+	/* 1, 2, 4, ..., maxthreads */
+	for (i = 1;; i = i * 2 < maxthreads ? i * 2 : maxthreads) {
+		(void)printf("    { \"threads\": %d, ", i);
+		rate = time_threads(false, hits, n, 1, i);
+		(void)printf("\"glob_per_sec\": %.1f, ", rate);
+		rate = time_threads(true, corpus, ncorpus, MAGIC_PASSES, i);
+		(void)printf("\"magic_per_sec\": %.1f }%s\n", rate,
+		    i < maxthreads ? "," : "");
+		if (i == maxthreads)
+			break;
+	}
+	(void)printf("  ]\n");
+	(void)printf("}\n");
+
+	rm_corpus(dir, corpus, ncorpus);
+	free_names(hits, n); free_names(misses, n); free_names(folded, n);
+	dsbmime_cleanup();
+
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,630 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Command line classifier. Paths are taken from the command line, or
+ * read from stdin, and passed in batches to a pool of worker threads.
+ * Each worker formats the results of a batch into its own buffer, and
+ * writes the buffer to stdout in one go.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <err.h>
+#include <fts.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "dsbmime.h"
+
+#define BATCH_SIZE	256
+#define BATCH_BUFSIZE	(BATCH_SIZE * 64)
+#define QUEUE_PER_THREAD 4
+#define ERROR_TYPE	"-"
+
+enum { FMT_TSV, FMT_JSON, FMT_SUMMARY };
+
+typedef struct buf_s {
+	char   *data;
+	size_t len;
+	size_t size;
+} buf_t;
+
+/*
+ * A batch of paths. The paths are stored back to back in buf, and
+ * off[i] is the offset of the i-th path.
+ */
+typedef struct batch_s {
+	int	   n;
+	int	   errors[BATCH_SIZE];
+	size_t	   off[BATCH_SIZE];
+	buf_t	   buf;
+	const char *paths[BATCH_SIZE];
+	const char *types[BATCH_SIZE];
+} batch_t;
+
+/*
+ * Number of files per type. The type strings belong to the library,
+ * so they remain valid until dsbmime_cleanup() is called.
+ */
+typedef struct count_s {
+	const char *type;
+	uint64_t   n;
+} count_t;
+
+typedef struct counter_s {
+	size_t	size;
+	size_t	used;
+	count_t *tbl;
+} counter_t;
+
+typedef struct worker_s {
+	buf_t	  out;
+	counter_t counts;
+	uint64_t  files;
+	uint64_t  errors;
+	pthread_t tid;
+} worker_t;
+
+static int	 format = FMT_TSV;
+static int	 qsize, qhead, qlen;
+static bool	 done;
+static batch_t	 **queue;
+static pthread_mutex_t qmtx   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t outmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  qfull  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  qempty = PTHREAD_COND_INITIALIZER;
+
+static const char *stage_names[DSBMIME_NSTAGES] = {
+	"glob-exact", "glob-folded", "glob-pattern", "magic", "text", "inode",
+	"container"
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+usage(void)
+{
+	(void)fprintf(stderr,
+	    "Usage: dsbmime [-0dRrs] [-a align] [-f tsv | json | summary] "
+	    "[-k prefetch]\n"
+	    "               [-p glob | magic | verify] [-t threads] "
+	    "[file ...]\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+buf_add(buf_t *bp, const char *s, size_t len)
+{
+	if (bp->len + len + 1 > bp->size) {
+		while (bp->len + len + 1 > bp->size)
+			bp->size = bp->size > 0 ? bp->size * 2 : BATCH_BUFSIZE;
+		if ((bp->data = realloc(bp->data, bp->size)) == NULL)
+			err(EXIT_FAILURE, "realloc()");
+	}
+	(void)memcpy(bp->data + bp->len, s, len);
+	bp->len += len;
+	bp->data[bp->len] = '\0';
+}
+
+static void
+buf_puts(buf_t *bp, const char *s)
+{
+	buf_add(bp, s, strlen(s));
+}
+
+/*
+ * Return the length of the valid UTF-8 sequence at p, or 0.
+ */
+static int
+utf8_len(const char *p)
+{
+	int	      i, n;
+	unsigned char c, lo, hi;
+
+	if ((c = *p) < 0x80)
+		return (1);
+	if (c < 0xc2 || c > 0xf4)
+		return (0);
+	n  = c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+	/* Reject overlong forms, surrogates, and code points > 0x10ffff. */
+	lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+	hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+	for (i = 1; i < n; i++, lo = 0x80, hi = 0xbf) {
+		if ((unsigned char)p[i] < lo || (unsigned char)p[i] > hi)
+			return (0);
+	}
+	return (n);
+}
+
+/*
+ * Add the given string, and escape characters which would break the
+ * TSV or JSON output. JSON must be valid UTF-8, so bytes which are not
+ * part of a valid sequence are replaced by U+FFFD.
+ */
+static void
+buf_add_escaped(buf_t *bp, const char *s)
+{
+	int	   n;
+	char	   esc[8];
+	const char *p;
+
+	for (p = s; *p != '\0'; p += n) {
+		n = 1;
+		if ((unsigned char)*p >= 0x80 && format == FMT_JSON) {
+			if ((n = utf8_len(p)) > 0)
+				continue;
+			buf_add(bp, s, p - s);
+			buf_puts(bp, "\\ufffd");
+			s = p + 1; n = 1;
+			continue;
+		}
+		if ((unsigned char)*p >= 0x20 && *p != '\\' && *p != '"')
+			continue;
+		buf_add(bp, s, p - s);
+		s = p + 1;
+		if (*p == '"' && format != FMT_JSON)
+			buf_add(bp, p, 1);
+		else if (*p == '\\' || *p == '"') {
+			esc[0] = '\\'; esc[1] = *p;
+			buf_add(bp, esc, 2);
+		} else if (*p == '\t')
+			buf_puts(bp, "\\t");
+		else if (*p == '\n')
+			buf_puts(bp, "\\n");
+		else if (*p == '\r')
+			buf_puts(bp, "\\r");
+		else {
+			(void)snprintf(esc, sizeof(esc), "\\u%04x",
+			    (unsigned char)*p);
+			buf_puts(bp, esc);
+		}
+	}
+	buf_add(bp, s, p - s);
+}
+
+static size_t
+hash(const char *s)
+{
+	size_t h;
+
+	for (h = 5381; *s != '\0'; s++)
+		h = h * 33 + (unsigned char)*s;
+	return (h);
+}
+
+static void
+count_type(counter_t *cp, const char *type, uint64_t n)
+{
+	size_t	i, j, size;
+	count_t *tbl;
+
+	if (cp->used * 2 >= cp->size) {
+		size = cp->size > 0 ? cp->size * 2 : 256;
+		if ((tbl = calloc(size, sizeof(count_t))) == NULL)
+			err(EXIT_FAILURE, "calloc()");
+		for (i = 0; i < cp->size; i++) {
+			if (cp->tbl[i].type == NULL)
+				continue;
+			for (j = hash(cp->tbl[i].type) & (size - 1);
+			    tbl[j].type != NULL; j = (j + 1) & (size - 1))
+				;
+			tbl[j] = cp->tbl[i];
+		}
+		free(cp->tbl);
+		cp->tbl = tbl; cp->size = size;
+	}
+	for (i = hash(type) & (cp->size - 1); cp->tbl[i].type != NULL;
+	    i = (i + 1) & (cp->size - 1)) {
+		if (strcmp(cp->tbl[i].type, type) == 0) {
+			cp->tbl[i].n += n;
+			return;
+		}
+	}
+	cp->tbl[i].type = type;
+	cp->tbl[i].n = n;
+	cp->used++;
+}
+
+static void
+add_result(worker_t *wp, const char *path, const char *type, int errnum)
+{
+	const char *error;
+
+	wp->files++;
+	if (type == NULL) {
+		/* Glob only lookups fail without setting errno. */
+		error = errnum != 0 ? strerror(errnum) : "No matching pattern";
+		wp->errors++;
+	}
+	if (format == FMT_SUMMARY) {
+		count_type(&wp->counts, type != NULL ? type : ERROR_TYPE, 1);
+		return;
+	}
+	if (format == FMT_JSON) {
+		buf_puts(&wp->out, "{\"path\": \"");
+		buf_add_escaped(&wp->out, path);
+		if (type != NULL) {
+			buf_puts(&wp->out, "\", \"type\": \"");
+			buf_puts(&wp->out, type);
+			buf_puts(&wp->out, "\"}\n");
+		} else {
+			buf_puts(&wp->out, "\", \"type\": null, \"error\": \"");
+			buf_puts(&wp->out, error);
+			buf_puts(&wp->out, "\"}\n");
+		}
+		return;
+	}
+	buf_add_escaped(&wp->out, path);
+	buf_puts(&wp->out, "\t");
+	if (type != NULL)
+		buf_puts(&wp->out, type);
+	else {
+		buf_puts(&wp->out, ERROR_TYPE "\t");
+		buf_puts(&wp->out, error);
+	}
+	buf_puts(&wp->out, "\n");
+}
+
+static batch_t *
+dequeue(void)
+{
+	batch_t *bp;
+
+	(void)pthread_mutex_lock(&qmtx);
+	while (qlen == 0 && !done)
+		(void)pthread_cond_wait(&qempty, &qmtx);
+	if (qlen == 0) {
+		(void)pthread_mutex_unlock(&qmtx);
+		return (NULL);
+	}
+	bp = queue[qhead];
+	qhead = (qhead + 1) % qsize;
+	qlen--;
+	(void)pthread_cond_signal(&qfull);
+	(void)pthread_mutex_unlock(&qmtx);
+
+	return (bp);
+}
+
+static void
+enqueue(batch_t *bp)
+{
+	(void)pthread_mutex_lock(&qmtx);
+	while (qlen == qsize)
+		(void)pthread_cond_wait(&qfull, &qmtx);
+	queue[(qhead + qlen) % qsize] = bp;
+	qlen++;
+	(void)pthread_cond_signal(&qempty);
+	(void)pthread_mutex_unlock(&qmtx);
+}
+
+static void *
+run_worker(void *arg)
+{
+	int	 i, error;
+	batch_t	 *bp;
+	worker_t *wp = arg;
+
+	while ((bp = dequeue()) != NULL) {
+		for (i = 0; i < bp->n; i++)
+			bp->paths[i] = bp->buf.data + bp->off[i];
+		if (dsbmime_get_types(bp->paths, bp->n, bp->types,
+		    bp->errors) == -1) {
+			/* Report every file of the batch as failed. */
+			error = errno != 0 ? errno : EINVAL;
+			warn("dsbmime_get_types()");
+			for (i = 0; i < bp->n; i++) {
+				bp->types[i]  = NULL;
+				bp->errors[i] = error;
+			}
+		}
+		for (i = 0; i < bp->n; i++)
+			add_result(wp, bp->paths[i], bp->types[i],
+			    bp->errors[i]);
+		free(bp->buf.data);
+		free(bp);
+		if (wp->out.len == 0)
+			continue;
+		(void)pthread_mutex_lock(&outmtx);
+		(void)fwrite(wp->out.data, 1, wp->out.len, stdout);
+		(void)pthread_mutex_unlock(&outmtx);
+		wp->out.len = 0;
+	}
+	return (NULL);
+}
+
+/*
+ * Add a path to the current batch, and pass the batch to the workers
+ * if it's full. A NULL path flushes the current batch.
+ */
+static void
+add_path(const char *path)
+{
+	static batch_t *bp;
+
+	if (path != NULL) {
+		if (bp == NULL && (bp = calloc(1, sizeof(batch_t))) == NULL)
+			err(EXIT_FAILURE, "calloc()");
+		bp->off[bp->n++] = bp->buf.len;
+		buf_add(&bp->buf, path, strlen(path) + 1);
+		if (bp->n < BATCH_SIZE)
+			return;
+	}
+	if (bp != NULL && bp->n > 0)
+		enqueue(bp);
+	bp = NULL;
+}
+
+/*
+ * Add the given path. If recurse is set, and path is a directory, add
+ * all non-directory files below it instead. Symbolic links to
+ * directories are not searched.
+ */
+static void
+add_file(const char *path, bool recurse)
+{
+	FTS	   *fts;
+	FTSENT	   *ent;
+	char *const argv[] = { (char *)path, NULL };
+
+	if (!recurse) {
+		add_path(path);
+		return;
+	}
+	if ((fts = fts_open(argv, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL)
+		err(EXIT_FAILURE, "fts_open()");
+	while ((ent = fts_read(fts)) != NULL) {
+		switch (ent->fts_info) {
+		case FTS_D:
+		case FTS_DP:
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+			warnx("%s: %s", ent->fts_path,
+			    strerror(ent->fts_errno));
+			break;
+		default:
+			add_path(ent->fts_path);
+		}
+	}
+	(void)fts_close(fts);
+}
+
+static void
+read_paths(int sep, bool recurse)
+{
+	char	*line;
+	size_t	size;
+	ssize_t len;
+
+	for (line = NULL, size = 0;
+	    (len = getdelim(&line, &size, sep, stdin)) != -1;) {
+		if (len > 0 && line[len - 1] == sep)
+			line[--len] = '\0';
+		if (len > 0)
+			add_file(line, recurse);
+	}
+	if (ferror(stdin))
+		err(EXIT_FAILURE, "getdelim()");
+	free(line);
+}
+
+static int
+cmp_counts(const void *a, const void *b)
+{
+	const count_t *c1 = a, *c2 = b;
+
+	if (c1->n != c2->n)
+		return (c1->n < c2->n ? 1 : -1);
+	return (strcmp(c1->type, c2->type));
+}
+
+static void
+print_summary(worker_t *workers, int nworkers)
+{
+	int	  i;
+	size_t	  j, n;
+	count_t	  *cp;
+	counter_t total;
+
+	(void)memset(&total, 0, sizeof(total));
+	for (i = 0; i < nworkers; i++) {
+		for (j = 0; j < workers[i].counts.size; j++) {
+			cp = &workers[i].counts.tbl[j];
+			if (cp->type != NULL)
+				count_type(&total, cp->type, cp->n);
+		}
+	}
+	/* Move the used slots to the front, and sort them. */
+	for (j = n = 0; j < total.size; j++) {
+		if (total.tbl[j].type != NULL)
+			total.tbl[n++] = total.tbl[j];
+	}
+	qsort(total.tbl, n, sizeof(count_t), cmp_counts);
+	for (j = 0; j < n; j++) {
+		(void)printf("%llu\t%s\n", (unsigned long long)total.tbl[j].n,
+		    total.tbl[j].type);
+	}
+	free(total.tbl);
+}
+
+static void
+print_stats(uint64_t files, uint64_t errors, double t)
+{
+	int		i;
+	dsbmime_stats_t st;
+
+	(void)fprintf(stderr, "files:        %llu\n",
+	    (unsigned long long)files);
+	(void)fprintf(stderr, "errors:       %llu\n",
+	    (unsigned long long)errors);
+	(void)fprintf(stderr, "time:         %.3f s\n", t);
+	(void)fprintf(stderr, "files/s:      %.1f\n", t > 0 ? files / t : 0);
+	if (dsbmime_get_stats(&st) == -1) {
+		(void)fprintf(stderr, "Library built without statistics\n");
+		return;
+	}
+	(void)fprintf(stderr, "bytes read:   %llu\n",
+	    (unsigned long long)st.magic_bytes);
+	(void)fprintf(stderr, "files opened: %llu\n",
+	    (unsigned long long)st.magic_opens);
+	for (i = 0; i < DSBMIME_NSTAGES; i++) {
+		(void)fprintf(stderr, "%-13s %llu (%.1f%%)\n", stage_names[i],
+		    (unsigned long long)st.hits[i], st.lookups > 0 ?
+		    100.0 * st.hits[i] / st.lookups : 0);
+	}
+	(void)fprintf(stderr, "%-13s %llu (%.1f%%)\n", "miss",
+	    (unsigned long long)st.misses, st.lookups > 0 ?
+	    100.0 * st.misses / st.lookups : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int	     ch, i, sep, flags, nthreads;
+	bool	     recurse, stats;
+	double	     t;
+	uint64_t     files, errors;
+	worker_t     *workers;
+	dsbmime_io_t io;
+
+	sep = '\n'; flags = 0; recurse = stats = false;
+	(void)memset(&io, 0, sizeof(io));
+	if ((nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nthreads = 1;
+	while ((ch = getopt(argc, argv, "0a:df:k:p:Rrst:h")) != -1) {
+		switch (ch) {
+		case '0':
+			sep = '\0';
+			break;
+		case 'a':
+			io.align = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			io.flags |= DSBMIME_IO_DONTNEED;
+			break;
+		case 'f':
+			if (strcmp(optarg, "tsv") == 0)
+				format = FMT_TSV;
+			else if (strcmp(optarg, "json") == 0)
+				format = FMT_JSON;
+			else if (strcmp(optarg, "summary") == 0)
+				format = FMT_SUMMARY;
+			else
+				usage();
+			break;
+		case 'k':
+			if ((io.prefetch = atoi(optarg)) < 0)
+				usage();
+			break;
+		case 'p':
+			if (strcmp(optarg, "glob") == 0)
+				flags = DSBMIME_POLICY_GLOB_ONLY;
+			else if (strcmp(optarg, "magic") == 0)
+				flags = DSBMIME_POLICY_MAGIC_ONLY;
+			else if (strcmp(optarg, "verify") == 0)
+				flags = DSBMIME_POLICY_VERIFY_GLOB;
+			else
+				usage();
+			break;
+		case 'R':
+			io.flags |= DSBMIME_IO_NOREADAHEAD;
+			break;
+		case 'r':
+			recurse = true;
+			break;
+		case 's':
+			stats = true;
+			break;
+		case 't':
+			if ((nthreads = atoi(optarg)) < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (dsbmime_init() == -1)
+		errx(EXIT_FAILURE, "Couldn't init mime lib");
+	if (dsbmime_set_policy(flags, 0) == -1)
+		err(EXIT_FAILURE, "dsbmime_set_policy()");
+	if (dsbmime_set_io(&io) == -1)
+		err(EXIT_FAILURE, "dsbmime_set_io()");
+	qsize = nthreads * QUEUE_PER_THREAD;
+	if ((queue = malloc(qsize * sizeof(batch_t *))) == NULL ||
+	    (workers = calloc(nthreads, sizeof(worker_t))) == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	t = now();
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&workers[i].tid, NULL, run_worker,
+		    &workers[i]) != 0)
+			errx(EXIT_FAILURE, "pthread_create() failed");
+	}
+	if (argc == 0)
+		read_paths(sep, recurse);
+	for (i = 0; i < argc; i++)
+		add_file(argv[i], recurse);
+	add_path(NULL);
+
+	(void)pthread_mutex_lock(&qmtx);
+	done = true;
+	(void)pthread_cond_broadcast(&qempty);
+	(void)pthread_mutex_unlock(&qmtx);
+
+	for (i = 0, files = errors = 0; i < nthreads; i++) {
+		(void)pthread_join(workers[i].tid, NULL);
+		files  += workers[i].files;
+		errors += workers[i].errors;
+	}
+	t = now() - t;
+	if (format == FMT_SUMMARY)
+		print_summary(workers, nthreads);
+	(void)fflush(stdout);
+	if (stats)
+		print_stats(files, errors, t);
+	for (i = 0; i < nthreads; i++) {
+		free(workers[i].out.data);
+		free(workers[i].counts.tbl);
+	}
+	free(workers); free(queue);
+	dsbmime_cleanup();
+
+	return (errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
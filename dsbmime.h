@@ -24,13 +24,115 @@
 
 #ifndef _DSBMIME_H_
 #define _DSBMIME_H_
+#include <stddef.h>
+#include <stdint.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * Lookup stages as used by dsbmime_stats_t.
+ */
+#define DSBMIME_STAGE_GLOB_EXACT   0	/* Case sensitive hash lookup */
+#define DSBMIME_STAGE_GLOB_FOLDED  1	/* Case insensitive hash lookup */
+#define DSBMIME_STAGE_GLOB_PATTERN 2	/* fnmatch() fallback */
+#define DSBMIME_STAGE_MAGIC	   3	/* Content based lookup */
+#define DSBMIME_STAGE_TEXT	   4	/* Text/binary heuristic */
+#define DSBMIME_STAGE_INODE	   5	/* Special and empty files */
+#define DSBMIME_STAGE_CONTAINER	   6	/* ZIP based formats */
+#define DSBMIME_NSTAGES		   7
+
+#define DSBMIME_HIST_BUCKETS	   32
+
+typedef struct dsbmime_stats_s {
+	uint64_t lookups;		  /* Files and streams looked up */
+	uint64_t misses;		  /* Lookups without result */
+	uint64_t hits[DSBMIME_NSTAGES];	  /* Lookups answered per stage */
+	uint64_t magic_sections;	  /* Magic sections tested */
+	uint64_t magic_bytes;		  /* Bytes read by the content stages */
+	uint64_t magic_opens;		  /* Files opened by the magic stage */
+	/*
+	 * Latency histogram per stage. Bucket i counts stage runs which
+	 * took less than 2^i nanoseconds. Only updated if enabled by
+	 * dsbmime_stats_timing().
+	 */
+	uint64_t latency[DSBMIME_NSTAGES][DSBMIME_HIST_BUCKETS];
+} dsbmime_stats_t;
+
+typedef struct dsbmime_memory_s {
+	size_t globs;			  /* Patterns and their hash table */
+	size_t magic;			  /* Magic sections and records */
+	size_t hierarchy;		  /* Subclasses and aliases */
+	size_t stats;			  /* Per-thread statistics */
+	size_t total;
+} dsbmime_memory_t;
+
+typedef struct dsbmime_stream_s dsbmime_stream_t;
+
+/*
+ * Lookup policy flags for dsbmime_set_policy() and
+ * dsbmime_get_type_policy(). 0 is the default policy: Look up the name,
+ * and the content if the name doesn't match.
+ */
+#define DSBMIME_POLICY_GLOB_ONLY   0x01	/* Never access the file */
+#define DSBMIME_POLICY_MAGIC_ONLY  0x02	/* Ignore the name */
+#define DSBMIME_POLICY_VERIFY_GLOB 0x04	/* Check the name by the content */
+
+/*
+ * I/O settings for dsbmime_set_io(). The prefix of a file is read in one
+ * request, whose size is rounded up to a multiple of align if align is
+ * not 0. dsbmime_get_types() asks the kernel to read the prefixes of the
+ * next prefetch files in the background.
+ */
+#define DSBMIME_IO_NOREADAHEAD	   0x01	/* Disable the kernel's readahead */
+#define DSBMIME_IO_DONTNEED	   0x02	/* Drop read pages from the cache */
+
+typedef struct dsbmime_io_s {
+	int    flags;
+	int    prefetch;			  /* Files to prefetch */
+	size_t align;				  /* Power of 2, or 0 */
+} dsbmime_io_t;
+
+/* Sources of the candidates returned by dsbmime_get_candidates(). */
+#define DSBMIME_SOURCE_GLOB	   0	/* Score is the pattern's weight */
+#define DSBMIME_SOURCE_MAGIC	   1	/* Score is the section's priority */
+#define DSBMIME_SOURCE_TEXT	   2	/* Score is 0 */
+#define DSBMIME_SOURCE_INODE	   3	/* Score is 100 */
+#define DSBMIME_SOURCE_CONTAINER   4	/* Score is 100 */
+
+typedef struct dsbmime_candidate_s {
+	const char *type;
+	int	   source;
+	int	   score;
+} dsbmime_candidate_t;
+
 extern int	  dsbmime_init(void);
+extern int	  dsbmime_is_a(const char *, const char *);
+extern int	  dsbmime_get_stats(dsbmime_stats_t *);
+extern int	  dsbmime_memory_usage(dsbmime_memory_t *);
+extern int	  dsbmime_get_candidates(const char *, dsbmime_candidate_t *,
+		    int);
+extern int	  dsbmime_set_adaptive(unsigned int);
+extern int	  dsbmime_save_order(const char *);
+extern int	  dsbmime_load_order(const char *);
+extern int	  dsbmime_set_policy(int, size_t);
+extern int	  dsbmime_set_io(const dsbmime_io_t *);
+extern int	  dsbmime_get_types(const char *const *, int, const char **,
+		    int *);
+extern int	  dsbmime_stream_push(dsbmime_stream_t *, const void *, size_t);
+extern int	  dsbmime_stream_read(dsbmime_stream_t *, int);
 extern void	  dsbmime_cleanup(void);
+extern void	  dsbmime_stream_close(dsbmime_stream_t *);
+extern void	  dsbmime_reset_stats(void);
+extern void	  dsbmime_stats_timing(int);
 extern const char *dsbmime_get_type(const char *);
+extern const char *dsbmime_get_type_policy(const char *, int, size_t);
+extern const char *dsbmime_canonical(const char *);
+extern const char *dsbmime_stream_finish(dsbmime_stream_t *);
+extern const char *dsbmime_stream_type(const dsbmime_stream_t *);
+extern dsbmime_stream_t *dsbmime_stream_open(const char *);
+extern const unsigned char *dsbmime_stream_data(const dsbmime_stream_t *,
+		    size_t *);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,1595 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Differential fuzzer and performance regression check for the glob and
+ * magic matching engines.
+ *
+ * Each iteration generates random globs2 and magic files, loads them
+ * with glob_init() and magic_init(), and compares the results of
+ * glob_lookup_mime_type(), magic_match_buffer() and magic_match_partial()
+ * for random file names and contents with those of the oracle, the
+ * matching code of the first release in oracle/. It tests the rules one
+ * after another, without packed arrays or a learned section order. Any
+ * optimization of the engines must give the same results. Mutated copies
+ * of the files are loaded as well, to make sure the parsers survive
+ * garbage.
+ *
+ * The first release reads a single file, and gets masks, word sizes and
+ * long ranges wrong. Every fourth iteration generates rules using those,
+ * and several files with __NOGLOBS__ and __NOMAGIC__ entries. Then the
+ * results of the library's first lookups are expected after the section
+ * order changed, and after loading the most important file once more, as
+ * the least important one.
+ *
+ * Built with -DFUZZ_LIBFUZZER, LLVMFuzzerTestOneInput() compares file
+ * names and contents from libFuzzer with the oracle instead.
+ *
+ * With -p, fixed micro benchmarks are run on the installed MIME
+ * database instead, and compared against a baseline written by an
+ * earlier run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "dsbmime.h"
+#include "glob.h"
+#include "magic.h"
+
+#define DEFAULT_ITER	  1000
+#define DEFAULT_SEED	  1
+#define DEFAULT_THRESHOLD 20
+
+#define MAX_LAYERS	  3
+#define MAX_PATTERNS	  4096
+#define MAX_SECTIONS	  2048
+#define MAX_RECORDS	  64
+#define MAX_VLEN	  128
+#define GEN_RECORDS	  8
+#define MAX_CONTENT	  1024
+#define NAMES		  200
+#define CONTENTS	  100
+#define NOGLOBS		  "__NOGLOBS__"
+#define NOMAGIC		  "__NOMAGIC__"
+
+#define PERF_OPS	  200000	/* Glob lookups per run */
+#define PERF_MAGIC_OPS	  2000	/* Magic lookups per run */
+#define PERF_PARTIAL_OPS  2000000	/* Partial magic lookups per run */
+#define PERF_RUNS	  7
+#define PERF_RETRIES	  3
+#define PERF_SAMPLE	  512
+#define MAX_BENCH	  16
+
+typedef struct pattern_s {
+	int  weight;
+	int  layer;
+	char type[128];
+	char glob[256];
+} pattern_t;
+
+typedef struct record_s {
+	int	indent;
+	int	wsize;
+	int	vlen;
+	bool	hasmask;
+	int64_t offset;
+	int64_t rangelen;
+	u_char	val[MAX_VLEN];
+	u_char	mask[MAX_VLEN];
+} record_t;
+
+typedef struct section_s {
+	int	 prio;
+	int	 nrec;
+	int	 layer;		/* Rank of the magic file */
+	int	 seq;		/* Position in the file */
+	char	 type[128];
+	record_t rec[MAX_RECORDS];
+} section_t;
+
+/*
+ * A file name, and the expected results of a case sensitive and of a
+ * folded lookup.
+ */
+typedef struct probe_s {
+	int  weight[2];
+	char *type[2];
+	char name[256];
+} probe_t;
+
+/*
+ * File content, and the expected result of a magic lookup.
+ */
+typedef struct input_s {
+	char   *type;
+	size_t len;
+	u_char data[MAX_CONTENT];
+} input_t;
+
+typedef struct bench_s {
+	const char *name;
+	double	   (*fn)(void *);
+	void	   *arg;
+	double	   ns;		/* Best time per operation */
+	double	   base;	/* Time of the baseline, or 0 */
+	bool	   measure;	/* Run again */
+} bench_t;
+
+static int	 npatterns, nlayers, nsections, nmlayers;
+static int	 maxreach;
+static int	 weight;	/* Weight of all patterns if plain */
+static bool	 generated;
+static bool	 plain;		/* Rules the oracle reads correctly */
+static char	 dir[64];
+static char	 globpath[MAX_LAYERS][80], magicpath[MAX_LAYERS][80];
+static char	 mutpath[80], orderpath[2][80];
+static char	 oglobpath[80], contentpath[80];
+static u_char	 content[MAX_CONTENT];
+static uint64_t	 rng_state;
+static probe_t	 probes[NAMES];
+static input_t	 inputs[CONTENTS];
+static pattern_t patterns[MAX_PATTERNS];
+static section_t sections[MAX_SECTIONS];
+
+/*
+ * The first release's glob.c and magic.c, compiled by oracle/oracle.c.
+ */
+extern int	  oracle_glob_init(const char *);
+extern void	  oracle_glob_cleanup(void);
+extern const char *oracle_glob_lookup_mime_type(const char *, bool);
+extern int	  oracle_magic_init(const char *);
+extern void	  oracle_magic_free(void);
+extern const char *oracle_magic_lookup_mime_type(const char *);
+
+/*
+ * Bytes the generated values, masks and contents are made of. Few
+ * distinct values, so that rules actually match.
+ */
+static const u_char alphabet[] = { 0x00, 0x0a, 'A', 'B', 'a', 0xff };
+
+static uint64_t
+rng(void)
+{
+	uint64_t z;
+
+	/* splitmix64 */
+	z = (rng_state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+static int
+rnd(int n)
+{
+	return ((int)(rng() % n));
+}
+
+/*
+ * Rule generation.
+ */
+
+static void
+gen_ext(char *buf, int len)
+{
+	static const char chars[] = "abcAB.";
+
+	while (len-- > 0)
+		*buf++ = chars[rnd(sizeof(chars) - 1)];
+	*buf = '\0';
+}
+
+/*
+ * Generate a pattern with wildcards. For plain rules, extensions are
+ * kept to three characters, see oracle_buckets().
+ */
+static void
+gen_wildcard(char *buf)
+{
+	int	    n;
+	static const char *tokens[] = {
+		"a", "b", "A", ".", "x", "*", "?", "[ab]", "[!a]", "*.", "/"
+	};
+
+	for (*buf = '\0', n = 1 + rnd(plain ? 4 : 5); n > 0; n--)
+		(void)strcat(buf, tokens[rnd(sizeof(tokens) / sizeof(char *))]);
+}
+
+static bool
+is_repeated(const pattern_t *pp)
+{
+	const pattern_t *p;
+
+	for (p = patterns; p < pp; p++) {
+		if (p->layer == pp->layer && strcmp(p->type, pp->type) == 0 &&
+		    strcmp(p->glob, pp->glob) == 0)
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Generate the patterns of one to MAX_LAYERS globs files. Plain rules
+ * are a single file without __NOGLOBS__ entries or repeated patterns,
+ * which the first release would find twice, and all patterns have the
+ * same weight, which it ignores.
+ */
+static void
+gen_globs(void)
+{
+	int	  i, n, layer;
+	pattern_t *pp;
+
+	nlayers = !plain && rnd(4) == 0 ? 2 + rnd(MAX_LAYERS - 1) : 1;
+	weight	= (const int []){ 10, 50, 80 }[rnd(3)];
+	for (npatterns = 0, layer = 0; layer < nlayers; layer++) {
+		for (n = 1 + rnd(40), i = 0; i < n; i++) {
+			pp = &patterns[npatterns++];
+			pp->layer  = layer;
+			pp->weight = plain ? weight :
+			    (const int []){ 10, 50, 50, 80 }[rnd(4)];
+			(void)snprintf(pp->type, sizeof(pp->type), "t/g%d",
+			    rnd(10));
+			if (!plain && rnd(20) == 0)
+				(void)strcpy(pp->glob, NOGLOBS);
+			else if (rnd(4) == 0)
+				gen_wildcard(pp->glob);
+			else if (npatterns > 1 && rnd(10) == 0) {
+				/* Duplicate a pattern. */
+				(void)strcpy(pp->glob,
+				    patterns[rnd(npatterns - 1)].glob);
+			} else {
+				(void)strcpy(pp->glob, "*.");
+				gen_ext(pp->glob + 2, 1 + rnd(3));
+			}
+			if (plain && is_repeated(pp))
+				npatterns--;
+		}
+	}
+}
+
+static void
+gen_record(record_t *rec, int indent)
+{
+	int i;
+
+	rec->indent  = indent;
+	rec->vlen    = rnd(16) == 0 ? 64 + rnd(MAX_VLEN - 64) : 1 + rnd(3);
+	rec->wsize   = rnd(8) == 0 ? (const int []){ 1, 2, 4 }[rnd(3)] : 1;
+	rec->hasmask = rnd(4) == 0;
+	/*
+	 * Some offsets and ranges are invalid, or overflow when added up.
+	 * The library must ignore those records.
+	 */
+	switch (rnd(24)) {
+	case 0:
+		rec->offset = -1 - rnd(64);
+		break;
+	case 1:
+		rec->offset = INT_MAX - rnd(16);
+		break;
+	case 2:
+		rec->offset = 99999999999LL;
+		break;
+	case 3:
+		rec->offset = MAGIC_MAX_EXTENT - rnd(2 * MAX_VLEN);
+		break;
+	case 4: case 5: case 6: case 7: case 8: case 9:
+		rec->offset = rnd(64);
+		break;
+	default:
+		rec->offset = rnd(8);
+	}
+	switch (rnd(16)) {
+	case 0:
+		rec->rangelen = 100 + rnd(400);
+		break;
+	case 1:
+		rec->rangelen = UINT16_MAX - 1 + rnd(3);
+		break;
+	case 2:
+		rec->rangelen = rnd(2) == 0 ? 0 : 99999;
+		break;
+	case 3: case 4: case 5: case 6:
+		rec->rangelen = 2 + rnd(16);
+		break;
+	default:
+		rec->rangelen = 1;
+	}
+	for (i = 0; i < rec->vlen; i++) {
+		rec->val[i]  = alphabet[rnd(sizeof(alphabet))];
+		rec->mask[i] = (const u_char []){ 0xff, 0x0f, 0xf0, 0x00,
+		    0x5a }[rnd(5)];
+	}
+	if (!plain)
+		return;
+	/*
+	 * The first release drops masks and word sizes, keeps the range in
+	 * a char, and gives up on the section at a negative offset. It also
+	 * reads EOF as 0xff, so a value must not contain it.
+	 */
+	rec->wsize = 1;
+	rec->hasmask = false;
+	if (rec->offset < 0 || rec->offset >= 64)
+		rec->offset = rnd(64);
+	if (rec->rangelen < 1 || rec->rangelen > 127)
+		rec->rangelen = 1 + rnd(127);
+	for (i = 0; i < rec->vlen; i++)
+		if (rec->val[i] == 0xff)
+			rec->val[i] = 'a';
+}
+
+static void
+gen_nomagic(section_t *sec)
+{
+	sec->nrec = 1;
+	(void)memset(&sec->rec[0], 0, sizeof(record_t));
+	sec->rec[0].vlen = sizeof(NOMAGIC) - 1;
+	sec->rec[0].wsize = sec->rec[0].rangelen = 1;
+	(void)memcpy(sec->rec[0].val, NOMAGIC, sizeof(NOMAGIC) - 1);
+}
+
+/*
+ * Generate the sections of one to MAX_LAYERS magic files. Types are
+ * shared between the files, some sections are copies of sections of a
+ * more important file, and some are __NOMAGIC__ entries. Plain rules are
+ * a single file without __NOMAGIC__ entries.
+ */
+static void
+gen_magic(void)
+{
+	int	  i, j, n, prio, first, layer;
+	section_t *sec;
+
+	nmlayers = !plain && rnd(4) == 0 ? 2 + rnd(MAX_LAYERS - 1) : 1;
+	for (nsections = 0, layer = 0; layer < nmlayers; layer++) {
+		n = 1 + rnd(16);
+		for (first = nsections, prio = 90, i = 0; i < n; i++) {
+			/* Runs of equal priority, in descending order. */
+			if (rnd(3) == 0 && (prio -= 1 + rnd(20)) < 0)
+				prio = 0;
+			sec = &sections[nsections++];
+			sec->layer = layer;
+			sec->seq   = i;
+			if (first > 0 && rnd(6) == 0) {
+				/* Copy a section of a more important file. */
+				*sec = sections[rnd(first)];
+				sec->layer = layer;
+				sec->seq   = i;
+				if (rnd(2) == 0)
+					sec->prio = prio;
+				continue;
+			}
+			sec->prio = prio;
+			(void)snprintf(sec->type, sizeof(sec->type), "t/m%d",
+			    rnd(3) == 0 ? rnd(4) : nsections);
+			if (!plain && rnd(20) == 0) {
+				gen_nomagic(sec);
+				continue;
+			}
+			sec->nrec = 1 + rnd(GEN_RECORDS);
+			for (j = 0; j < sec->nrec; j++) {
+				gen_record(&sec->rec[j], j == 0 ? 0 :
+				    rnd(sec->rec[j - 1].indent + 2));
+			}
+			/*
+			 * Like most real ones, some sections start with a
+			 * signature at a fixed offset, and have no other top
+			 * level record. Those can be reordered.
+			 */
+			if (rnd(2) == 0) {
+				sec->rec[0].offset   = 0;
+				sec->rec[0].rangelen = 1;
+				for (j = 1; j < sec->nrec; j++)
+					if (sec->rec[j].indent == 0)
+						sec->rec[j].indent = 1;
+			}
+		}
+	}
+}
+
+/*
+ * Set maxreach to the end of the furthest valid record. Records with
+ * negative offsets, ranges which don't fit into 16 bits, or reaching
+ * beyond MAGIC_MAX_EXTENT, are ignored by the library.
+ */
+static void
+set_maxreach(void)
+{
+	int	       i, j;
+	int64_t	       reach;
+	const record_t *rec;
+
+	for (maxreach = 0, i = 0; i < nsections; i++) {
+		for (j = 0; j < sections[i].nrec; j++) {
+			rec = &sections[i].rec[j];
+			reach = rec->offset + rec->rangelen - 1 + rec->vlen;
+			if (rec->offset >= 0 && rec->rangelen <= UINT16_MAX &&
+			    reach <= MAGIC_MAX_EXTENT && reach > maxreach)
+				maxreach = reach;
+		}
+	}
+}
+
+static void
+write_globs(void)
+{
+	int  i, layer;
+	FILE *fp;
+
+	for (layer = 0; layer < nlayers; layer++) {
+		if ((fp = fopen(globpath[layer], "w")) == NULL)
+			err(EXIT_FAILURE, "fopen(%s)", globpath[layer]);
+		(void)fprintf(fp, "# Generated by fuzz\n");
+		for (i = 0; i < npatterns; i++) {
+			if (patterns[i].layer != layer)
+				continue;
+			(void)fprintf(fp, "%d:%s:%s\n", patterns[i].weight,
+			    patterns[i].type, patterns[i].glob);
+		}
+		if (fclose(fp) != 0)
+			err(EXIT_FAILURE, "fclose(%s)", globpath[layer]);
+	}
+}
+
+/*
+ * The first release compares the extensions in a hash bucket without
+ * regard to case, even in case sensitive lookups. Return the smallest
+ * prime table size of at least n, which keeps extensions of up to three
+ * characters apart, that only differ in case.
+ *
+ * The hash is a number in base 27 modulo the table size, and the digits
+ * of a letter and its upper case differ by 5 or -22. So two of those
+ * extensions share a bucket if the size divides a sum of d * 27^k, with
+ * d one of 0, 5, -5, 22 or -22 for k = 0, 1, 2, but not all 0.
+ */
+static int
+oracle_buckets(int n)
+{
+	int  p, i, sum;
+	bool ok;
+	static const int digit[] = { 0, 5, -5, 22, -22 };
+
+	for (p = n > 3 ? n : 3;; p++) {
+		for (ok = true, i = 2; ok && i * i <= p; i++)
+			ok = p % i != 0;
+		for (i = 1; ok && i < 125; i++) {
+			sum = digit[i / 25] * 27 * 27 + digit[i / 5 % 5] * 27 +
+			    digit[i % 5];
+			ok = sum % p != 0;
+		}
+		if (ok)
+			return (p);
+	}
+}
+
+/*
+ * Write the patterns of a plain globs file for the oracle, padded with
+ * patterns no name matches, so that its hash table gets the size chosen
+ * by oracle_buckets(). The size is the number of patterns.
+ */
+static void
+write_oracle_globs(void)
+{
+	int  i, n;
+	FILE *fp;
+
+	if ((fp = fopen(oglobpath, "w")) == NULL)
+		err(EXIT_FAILURE, "fopen(%s)", oglobpath);
+	for (i = 0; i < npatterns; i++) {
+		(void)fprintf(fp, "%d:%s:%s\n", patterns[i].weight,
+		    patterns[i].type, patterns[i].glob);
+	}
+	for (n = oracle_buckets(npatterns); i < n; i++)
+		(void)fprintf(fp, "%d:t/pad:*.~%d\n", weight, i);
+	if (fclose(fp) != 0)
+		err(EXIT_FAILURE, "fclose(%s)", oglobpath);
+}
+
+static void
+write_magic(void)
+{
+	int		i, j, layer;
+	FILE		*fp;
+	const record_t	*rec;
+
+	for (layer = 0; layer < nmlayers; layer++) {
+		if ((fp = fopen(magicpath[layer], "w")) == NULL)
+			err(EXIT_FAILURE, "fopen(%s)", magicpath[layer]);
+		(void)fwrite("MIME-Magic\0\n", 1, 12, fp);
+		for (i = 0; i < nsections; i++) {
+			if (sections[i].layer != layer)
+				continue;
+			(void)fprintf(fp, "[%d:%s]\n", sections[i].prio,
+			    sections[i].type);
+			for (j = 0; j < sections[i].nrec; j++) {
+				rec = &sections[i].rec[j];
+				if (rec->indent > 0)
+					(void)fprintf(fp, "%d", rec->indent);
+				(void)fprintf(fp, ">%lld=",
+				    (long long)rec->offset);
+				(void)fputc(rec->vlen >> 8, fp);
+				(void)fputc(rec->vlen & 0xff, fp);
+				(void)fwrite(rec->val, 1, rec->vlen, fp);
+				if (rec->hasmask) {
+					(void)fputc('&', fp);
+					(void)fwrite(rec->mask, 1, rec->vlen,
+					    fp);
+				}
+				if (rec->wsize != 1)
+					(void)fprintf(fp, "~%d", rec->wsize);
+				if (rec->rangelen != 1) {
+					(void)fprintf(fp, "+%lld",
+					    (long long)rec->rangelen);
+				}
+				(void)fputc('\n', fp);
+			}
+		}
+		if (fclose(fp) != 0)
+			err(EXIT_FAILURE, "fclose(%s)", magicpath[layer]);
+	}
+}
+
+/*
+ * Input generation.
+ */
+
+static void
+gen_name(char *buf, size_t size)
+{
+	int	   i, n;
+	char	   *p, tmp[256];
+	const char *glob;
+
+	if (rnd(5) == 0)
+		(void)strcpy(buf, (const char *[]){ "d.a/", "/x.B/", "." }
+		    [rnd(3)]);
+	else
+		*buf = '\0';
+	gen_ext(tmp, rnd(5));
+	(void)strcat(buf, tmp);
+	if (npatterns == 0 || rnd(4) == 0)
+		return;
+	glob = patterns[rnd(npatterns)].glob;
+	/* Turn the pattern into a name it probably matches. */
+	for (p = tmp, i = 0; glob[i] != '\0' && p < tmp + 64; i++) {
+		if (glob[i] == '*')
+			for (n = rnd(3); n > 0; n--)
+				*p++ = "ab."[rnd(3)];
+		else if (glob[i] == '?')
+			*p++ = 'a';
+		else if (glob[i] == '[') {
+			*p++ = glob[i + 1] == '!' ? 'b' : glob[i + 1];
+			while (glob[i] != ']' && glob[i + 1] != '\0')
+				i++;
+		} else if (rnd(4) == 0)
+			*p++ = toupper((unsigned char)glob[i]);
+		else
+			*p++ = glob[i];
+	}
+	*p = '\0';
+	if (rnd(2) == 0)
+		*buf = '\0';
+	if (strlen(buf) + strlen(tmp) < size)
+		(void)strcat(buf, tmp);
+}
+
+/*
+ * Fill the content buffer with random bytes, and write the values of
+ * some records of a random section to it. Return the length.
+ */
+static size_t
+gen_content(void)
+{
+	int		i, j, start, len;
+	u_char		mask;
+	const record_t	*rec;
+	const section_t *sec;
+
+	len = rnd(maxreach + 16 < MAX_CONTENT ? maxreach + 16 : MAX_CONTENT);
+	for (i = 0; i < MAX_CONTENT; i++)
+		content[i] = alphabet[rnd(sizeof(alphabet))];
+	if (nsections == 0 || rnd(4) == 0)
+		return (len);
+	sec = &sections[rnd(nsections)];
+	for (i = 0; i < sec->nrec; i++) {
+		rec = &sec->rec[i];
+		if (rnd(4) == 0 || rec->offset < 0 ||
+		    rec->offset >= MAX_CONTENT)
+			continue;
+		start = rec->offset + (rec->rangelen > 0 ?
+		    rnd(rec->rangelen) : 0);
+		if (start + rec->vlen > MAX_CONTENT)
+			continue;
+		for (j = 0; j < rec->vlen; j++) {
+			mask = rec->hasmask ? rec->mask[j] : 0xff;
+			content[start + j] = (content[start + j] & ~mask) |
+			    (rec->val[j] & mask);
+		}
+		if (start + rec->vlen > len && rnd(4) != 0)
+			len = start + rec->vlen;
+	}
+	return (len);
+}
+
+/*
+ * Differential testing.
+ */
+
+static void
+dump_content(const u_char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		(void)fprintf(stderr, "%02x%s", data[i],
+		    i % 32 == 31 || i + 1 == len ? "\n" : " ");
+}
+
+static void
+fail(uint64_t seed, const char *what, const char *expected, const char *got)
+{
+	(void)fprintf(stderr, "fuzz: %s differs for seed %llu: expected " \
+	    "%s, got %s\n", what, (unsigned long long)seed,
+	    expected != NULL ? expected : "(null)",
+	    got != NULL ? got : "(null)");
+	if (generated)
+		(void)fprintf(stderr, "fuzz: Input files kept in %s\n", dir);
+#ifdef FUZZ_LIBFUZZER
+	abort();
+#endif
+	exit(EXIT_FAILURE);
+}
+
+static bool
+same(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (strcmp(a, b) == 0);
+}
+
+static char *
+dup_type(const char *type)
+{
+	char *p;
+
+	if (type == NULL)
+		return (NULL);
+	if ((p = strdup(type)) == NULL)
+		err(EXIT_FAILURE, "strdup()");
+	return (p);
+}
+
+/*
+ * The first release only looks up files. Write the content to one, and
+ * look it up with the oracle. The file is written in place, since
+ * creating it anew each time is slow on some file systems.
+ */
+static const char *
+oracle_match(const u_char *data, size_t len)
+{
+	static int fd = -1;
+
+	if (fd == -1 && (fd = open(contentpath, O_WRONLY | O_CREAT,
+	    0644)) == -1)
+		err(EXIT_FAILURE, "open(%s)", contentpath);
+	if (pwrite(fd, data, len, 0) != (ssize_t)len ||
+	    ftruncate(fd, len) == -1)
+		err(EXIT_FAILURE, "write(%s)", contentpath);
+	return (oracle_magic_lookup_mime_type(contentpath));
+}
+
+/*
+ * Set the expected results for the probe's file name: those of the
+ * oracle for plain rules, else those of the library.
+ */
+static void
+set_probe(probe_t *pp)
+{
+	int	   i;
+	const char *type;
+
+	for (i = 0; i < 2; i++) {
+		if (plain) {
+			type = oracle_glob_lookup_mime_type(pp->name, i == 1);
+			pp->weight[i] = weight;
+		} else {
+			pp->weight[i] = -1;
+			type = glob_lookup_mime_type(pp->name, i == 1,
+			    &pp->weight[i]);
+		}
+		free(pp->type[i]);
+		pp->type[i] = dup_type(type);
+	}
+}
+
+static void
+check_probe(uint64_t seed, const char *what, const probe_t *pp)
+{
+	int	   i, w;
+	const char *type;
+
+	for (i = 0; i < 2; i++) {
+		w = -1;
+		type = glob_lookup_mime_type(pp->name, i == 1, &w);
+		if (same(pp->type[i], type) &&
+		    (type == NULL || w == pp->weight[i]))
+			continue;
+		(void)fprintf(stderr, "fuzz: File name \"%s\", %s, weight " \
+		    "%d (expected %d)\n", pp->name, i == 1 ? "folded" : "exact",
+		    w, pp->weight[i]);
+		fail(seed, what, pp->type[i], type);
+	}
+}
+
+/*
+ * Look up random file names. For plain rules, the results of the oracle
+ * are expected. Else the library's results must not change after
+ * loading the most important file once more, as the least important
+ * one.
+ */
+static void
+check_globs(uint64_t seed, char **paths)
+{
+	int i;
+
+	if (plain && oracle_glob_init(oglobpath) == -1)
+		errx(EXIT_FAILURE, "oracle_glob_init() failed");
+	if (glob_init(paths, nlayers) == -1)
+		errx(EXIT_FAILURE, "glob_init() failed");
+	for (i = 0; i < NAMES; i++) {
+		gen_name(probes[i].name, sizeof(probes[i].name));
+		set_probe(&probes[i]);
+		check_probe(seed, "Glob match", &probes[i]);
+	}
+	glob_cleanup();
+	if (plain) {
+		oracle_glob_cleanup();
+		return;
+	}
+	paths[nlayers] = paths[0];
+	if (glob_init(paths, nlayers + 1) == -1)
+		errx(EXIT_FAILURE, "glob_init() failed");
+	for (i = 0; i < NAMES; i++) {
+		check_probe(seed, "Glob match with a repeated file",
+		    &probes[i]);
+	}
+	glob_cleanup();
+}
+
+/*
+ * Copy the content to the input, and set the expected result: that of
+ * the oracle for plain rules, else that of the library.
+ */
+static void
+set_input(input_t *in, const u_char *data, size_t len)
+{
+	(void)memcpy(in->data, data, len);
+	in->len = len;
+	free(in->type);
+	in->type = dup_type(plain ? oracle_match(data, len) :
+	    magic_match_buffer(data, len));
+}
+
+static void
+check_input(uint64_t seed, const char *what, const input_t *in)
+{
+	int	   cut;
+	size_t	   size;
+	const char *mime;
+
+	mime = magic_match_buffer(in->data, in->len);
+	if (!same(in->type, mime)) {
+		dump_content(in->data, in->len);
+		fail(seed, what, in->type, mime);
+	}
+	/* The library only reads magic_prefix_size() bytes of a file. */
+	size = magic_prefix_size();
+	mime = magic_match_buffer(in->data, in->len < size ? in->len : size);
+	if (!same(in->type, mime)) {
+		dump_content(in->data, in->len);
+		fail(seed, "Magic match of the prefix", in->type, mime);
+	}
+	/* A decided partial match holds for every continuation. */
+	cut = rnd(in->len + 1);
+	if (magic_match_partial(in->data, cut, &mime) == 1 &&
+	    !same(in->type, mime)) {
+		(void)fprintf(stderr, "fuzz: Partial match of %d bytes\n", cut);
+		dump_content(in->data, in->len);
+		fail(seed, "Partial magic match", in->type, mime);
+	}
+}
+
+static void
+gen_inputs(void)
+{
+	int i;
+
+	for (i = 0; i < CONTENTS; i++)
+		set_input(&inputs[i], content, gen_content());
+}
+
+static void
+check_inputs(uint64_t seed, const char *what)
+{
+	int i;
+
+	for (i = 0; i < CONTENTS; i++)
+		check_input(seed, what, &inputs[i]);
+}
+
+/*
+ * Load random counters with magic_load_order(). The order written by
+ * magic_save_order() afterwards must list every section once, with its
+ * counters.
+ */
+static void
+check_order(uint64_t seed)
+{
+	int	  i, n, nlines;
+	char	  line[256], type[128], **lines;
+	u_int	  prio, hits, tests;
+	FILE	  *fp, *out;
+
+	if (magic_save_order(orderpath[1]) == -1)
+		errx(EXIT_FAILURE, "magic_save_order() failed");
+	if ((lines = malloc((nsections + 1) * sizeof(char *))) == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	if ((fp = fopen(orderpath[1], "r")) == NULL)
+		err(EXIT_FAILURE, "fopen(%s)", orderpath[1]);
+	if ((out = fopen(orderpath[0], "w")) == NULL)
+		err(EXIT_FAILURE, "fopen(%s)", orderpath[0]);
+	for (nlines = 0; fgets(line, sizeof(line), fp) != NULL; nlines++) {
+		if (nlines == nsections ||
+		    sscanf(line, "%u\t%127s", &prio, type) != 2)
+			fail(seed, "Saved section order", NULL, line);
+		tests = rnd(1000);
+		hits  = rnd(4) == 0 ? 0 : rnd(tests + 1);
+		(void)snprintf(line, sizeof(line), "%u\t%s\t%u\t%u\t%llu\n",
+		    prio, type, hits, tests,
+		    (unsigned long long)tests * rnd(64));
+		(void)fputs(line, out);
+		lines[nlines] = dup_type(line);
+	}
+	(void)fclose(fp);
+	if (fclose(out) != 0)
+		err(EXIT_FAILURE, "fclose(%s)", orderpath[0]);
+	if (magic_load_order(orderpath[0]) == -1)
+		errx(EXIT_FAILURE, "magic_load_order() failed");
+	if (magic_save_order(orderpath[1]) == -1)
+		errx(EXIT_FAILURE, "magic_save_order() failed");
+	if ((fp = fopen(orderpath[1], "r")) == NULL)
+		err(EXIT_FAILURE, "fopen(%s)", orderpath[1]);
+	for (n = 0; fgets(line, sizeof(line), fp) != NULL; n++) {
+		for (i = 0; i < nlines; i++) {
+			if (lines[i] != NULL && strcmp(lines[i], line) == 0)
+				break;
+		}
+		if (i == nlines)
+			fail(seed, "Section order", NULL, line);
+		free(lines[i]);
+		lines[i] = NULL;
+	}
+	(void)fclose(fp);
+	if (n != nlines)
+		fail(seed, "Section order", "more sections", "EOF");
+	free(lines);
+}
+
+/*
+ * Look up random contents. For plain rules, the results of the oracle
+ * are expected. Else those of the library's first lookups, which must
+ * not change after loading the most important file once more, as the
+ * least important one. A loaded or learned section order must not
+ * change the results either.
+ */
+static void
+check_magic(uint64_t seed, char **paths)
+{
+	int i;
+
+	if (plain && oracle_magic_init(magicpath[0]) == -1)
+		errx(EXIT_FAILURE, "oracle_magic_init() failed");
+	if (magic_init(paths, nmlayers) == -1)
+		errx(EXIT_FAILURE, "magic_init() failed");
+	gen_inputs();
+	check_inputs(seed, "Magic match");
+	check_order(seed);
+	if (plain)
+		gen_inputs();
+	check_inputs(seed, "Magic match in loaded order");
+	/*
+	 * Reordering takes quadratic time, so do it less often for many
+	 * sections.
+	 */
+	if (magic_set_adaptive(1 + rnd(4 + nsections / 8)) == -1)
+		errx(EXIT_FAILURE, "magic_set_adaptive() failed");
+	for (i = 0; i < 4; i++) {
+		if (plain)
+			gen_inputs();
+		check_inputs(seed, "Magic match in adaptive order");
+	}
+	(void)magic_set_adaptive(0);
+	magic_cleanup();
+	if (plain) {
+		oracle_magic_free();
+		return;
+	}
+	paths[nmlayers] = paths[0];
+	if (magic_init(paths, nmlayers + 1) == -1)
+		errx(EXIT_FAILURE, "magic_init() failed");
+	check_inputs(seed, "Magic match with a repeated file");
+	magic_cleanup();
+}
+
+static void
+make_dir(void)
+{
+	int i;
+
+	(void)snprintf(dir, sizeof(dir), "%s/dsbmime-fuzz.XXXXXX",
+	    getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp");
+	if (mkdtemp(dir) == NULL)
+		err(EXIT_FAILURE, "mkdtemp(%s)", dir);
+	for (i = 0; i < MAX_LAYERS; i++) {
+		(void)snprintf(globpath[i], sizeof(globpath[i]), "%s/globs%d",
+		    dir, i);
+		(void)snprintf(magicpath[i], sizeof(magicpath[i]),
+		    "%s/magic%d", dir, i);
+	}
+	for (i = 0; i < 2; i++) {
+		(void)snprintf(orderpath[i], sizeof(orderpath[i]),
+		    "%s/order%d", dir, i);
+	}
+	(void)snprintf(mutpath, sizeof(mutpath), "%s/mutated", dir);
+	(void)snprintf(oglobpath, sizeof(oglobpath), "%s/oracle-globs", dir);
+	(void)snprintf(contentpath, sizeof(contentpath), "%s/content", dir);
+}
+
+static void
+remove_dir(void)
+{
+	int i;
+
+	for (i = 0; generated && i < MAX_LAYERS; i++) {
+		(void)unlink(globpath[i]);
+		(void)unlink(magicpath[i]);
+	}
+	(void)unlink(mutpath);
+	(void)unlink(orderpath[0]); (void)unlink(orderpath[1]);
+	(void)unlink(oglobpath); (void)unlink(contentpath);
+	(void)rmdir(dir);
+}
+
+#ifdef FUZZ_LIBFUZZER
+/*
+ * Entry point for libFuzzer. The first byte of the input selects plain
+ * rules generated from it, the following bytes up to a newline are a
+ * file name, and the rest is the file's content. The library must give
+ * the oracle's results for both.
+ */
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	size_t	       i, n;
+	char	       *gpath, *mpath;
+	probe_t	       probe;
+	static int     rules = -1;
+	static bool    checked[256];
+	static input_t in;
+
+	if (size == 0)
+		return (0);
+	if (rules != data[0]) {
+		if (rules == -1) {
+			make_dir();
+			(void)atexit(remove_dir);
+		} else {
+			glob_cleanup(); magic_cleanup();
+			oracle_glob_cleanup(); oracle_magic_free();
+		}
+		rules = data[0];
+		rng_state = rules + 1;
+		generated = plain = true;
+		gen_globs();
+		gen_magic();
+		set_maxreach();
+		write_globs();
+		write_oracle_globs();
+		write_magic();
+		gpath = globpath[0]; mpath = magicpath[0];
+		/* Rules seen for the first time get all checks. */
+		if (!checked[rules]) {
+			check_globs(rules + 1, &gpath);
+			check_magic(rules + 1, &mpath);
+			checked[rules] = true;
+		}
+		if (glob_init(&gpath, 1) == -1 || magic_init(&mpath, 1) == -1 ||
+		    oracle_glob_init(oglobpath) == -1 ||
+		    oracle_magic_init(magicpath[0]) == -1)
+			errx(EXIT_FAILURE, "Couldn't load the rules");
+	}
+	/* Same input, same partial match. */
+	rng_state = size;
+	/* The padding patterns of the oracle's globs file contain a '~'. */
+	for (n = 0, i = 1; i < size && data[i] != '\n'; i++) {
+		if (n < sizeof(probe.name) - 1)
+			probe.name[n++] = data[i] == '~' ? '_' : data[i];
+	}
+	probe.name[n] = '\0';
+	probe.type[0] = probe.type[1] = NULL;
+	set_probe(&probe);
+	check_probe(rules + 1, "Glob match", &probe);
+	free(probe.type[0]); free(probe.type[1]);
+	if (i < size)
+		i++;
+	set_input(&in, data + i, size - i < MAX_CONTENT ? size - i :
+	    MAX_CONTENT);
+	check_input(rules + 1, "Magic match", &in);
+
+	return (0);
+}
+#else
+/*
+ * Reading the installed database for -D.
+ */
+
+static void
+read_globs(const char *path, int layer)
+{
+	char	  line[_POSIX2_LINE_MAX], *type, *glob;
+	FILE	  *fp;
+	pattern_t *pp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		(void)strtok(line, "\n");
+		if (!isdigit((unsigned char)line[0]) ||
+		    (type = strchr(line, ':')) == NULL ||
+		    (glob = strchr(++type, ':')) == NULL)
+			continue;
+		*glob++ = '\0';
+		if (npatterns == MAX_PATTERNS)
+			errx(EXIT_FAILURE, "%s: Too many patterns", path);
+		pp = &patterns[npatterns++];
+		pp->layer  = layer;
+		pp->weight = (int)strtol(line, NULL, 10);
+		(void)snprintf(pp->type, sizeof(pp->type), "%s", type);
+		(void)snprintf(pp->glob, sizeof(pp->glob), "%s", glob);
+	}
+	(void)fclose(fp);
+}
+
+static int
+read_number(FILE *fp, int *c)
+{
+	int n;
+
+	for (n = 0; isdigit(*c = fgetc(fp));)
+		n = n * 10 + *c - '0';
+	return (n);
+}
+
+static void
+read_magic(const char *path)
+{
+	int	  c, n;
+	FILE	  *fp;
+	record_t  *rec;
+	section_t *sec;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(EXIT_FAILURE, "fopen(%s)", path);
+	for (n = 0; n < 12; n++)
+		(void)fgetc(fp);
+	for (sec = NULL; (c = fgetc(fp)) != EOF;) {
+		if (c == '[') {
+			if (nsections == MAX_SECTIONS)
+				errx(EXIT_FAILURE, "%s: Too many sections",
+				    path);
+			sec = &sections[nsections];
+			sec->layer = 0;
+			sec->seq   = nsections++;
+			sec->nrec  = 0;
+			sec->prio = read_number(fp, &c);
+			for (n = 0; (c = fgetc(fp)) != ']' && c != EOF;)
+				if (n < sizeof(sec->type) - 1)
+					sec->type[n++] = (char)c;
+			sec->type[n] = '\0';
+			(void)fgetc(fp);
+			continue;
+		}
+		if (sec == NULL || sec->nrec == MAX_RECORDS)
+			errx(EXIT_FAILURE, "%s: Unsupported file", path);
+		rec = &sec->rec[sec->nrec++];
+		(void)ungetc(c, fp);
+		rec->indent  = read_number(fp, &c);
+		rec->offset  = read_number(fp, &c);
+		rec->vlen    = fgetc(fp) << 8;
+		rec->vlen   |= fgetc(fp);
+		rec->hasmask = false;
+		rec->wsize   = rec->rangelen = 1;
+		if (rec->vlen > MAX_VLEN)
+			errx(EXIT_FAILURE, "%s: Unsupported file", path);
+		(void)fread(rec->val, 1, rec->vlen, fp);
+		while ((c = fgetc(fp)) != '\n' && c != EOF) {
+			if (c == '&') {
+				rec->hasmask = true;
+				(void)fread(rec->mask, 1, rec->vlen, fp);
+			} else if (c == '~')
+				rec->wsize = read_number(fp, &c);
+			else if (c == '+')
+				rec->rangelen = read_number(fp, &c);
+			if (c == '\n')
+				break;
+		}
+	}
+	(void)fclose(fp);
+}
+
+/*
+ * Load a copy of the given file with some bytes changed, and do some
+ * lookups. There is nothing to compare; this only tests for crashes
+ * and memory errors.
+ */
+static void
+check_mutation(const char *path, bool magic)
+{
+	int	   i, n, fd;
+	char	   name[256], *mutpaths[1];
+	u_char	   *data;
+	const char *mime;
+	FILE	   *fp;
+	size_t	   len;
+	struct stat sb;
+
+	if ((fp = fopen(path, "r")) == NULL || fstat(fileno(fp), &sb) == -1)
+		err(EXIT_FAILURE, "fopen(%s)", path);
+	len = sb.st_size;
+	if ((data = malloc(len + 32)) == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	if (fread(data, 1, len, fp) != len)
+		err(EXIT_FAILURE, "fread(%s)", path);
+	(void)fclose(fp);
+	/* Keep the magic file's header, or there is nothing to parse. */
+	for (n = 1 + rnd(8); n > 0 && len > 12; n--) {
+		i = 12 + rnd(len - 12);
+		if (rnd(4) == 0 && len + 16 < sb.st_size + 32) {
+			/* Insert a long number. */
+			(void)memmove(data + i + 16, data + i, len - i);
+			(void)memset(data + i, '9', 16);
+			len += 16;
+		} else
+			data[i] = rnd(2) == 0 ?
+			    "0123456789[]>=&~+:-\n"[rnd(20)] : (u_char)rng();
+	}
+	if ((fd = open(mutpath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+	    write(fd, data, len) != (ssize_t)len || close(fd) == -1)
+		err(EXIT_FAILURE, "write(%s)", mutpath);
+	free(data);
+	mutpaths[0] = mutpath;
+	if (magic) {
+		if (magic_init(mutpaths, 1) == -1)
+			return;
+		for (i = 0; i < CONTENTS; i++) {
+			len = gen_content();
+			(void)magic_match_buffer(content, len);
+			(void)magic_match_partial(content, len, &mime);
+		}
+		magic_cleanup();
+	} else {
+		if (glob_init(mutpaths, 1) == -1)
+			return;
+		for (i = 0; i < NAMES; i++) {
+			gen_name(name, sizeof(name));
+			(void)glob_lookup_mime_type(name, i % 2 != 0, NULL);
+		}
+		glob_cleanup();
+	}
+}
+
+static void
+fuzz(const char *datadir, uint64_t seed, int niter)
+{
+	int	 i, iter;
+	char	 *paths[MAX_LAYERS + 1], *mpaths[MAX_LAYERS + 1];
+	uint64_t s;
+
+	make_dir();
+	for (i = 0; i < MAX_LAYERS; i++) {
+		paths[i]  = globpath[i];
+		mpaths[i] = magicpath[i];
+	}
+	if (!(generated = datadir == NULL)) {
+		(void)snprintf(globpath[0], sizeof(globpath[0]),
+		    "%s/mime/globs2", datadir);
+		(void)snprintf(magicpath[0], sizeof(magicpath[0]),
+		    "%s/mime/magic", datadir);
+		read_globs(globpath[0], 0);
+		read_magic(magicpath[0]);
+		set_maxreach();
+		nlayers = nmlayers = 1;
+	}
+	for (iter = 0; iter < niter; iter++) {
+		rng_state = s = seed + iter;
+		if (generated) {
+			plain = rnd(4) != 0;
+			gen_globs();
+			gen_magic();
+			set_maxreach();
+			write_globs();
+			write_magic();
+			if (plain)
+				write_oracle_globs();
+		}
+		check_globs(s, paths);
+		check_magic(s, mpaths);
+
+		if (generated && rnd(4) == 0) {
+			check_mutation(magicpath[0], true);
+			check_mutation(globpath[0], false);
+		}
+	}
+	remove_dir();
+	(void)printf("%d iterations, seeds %llu to %llu: No differences\n",
+	    niter, (unsigned long long)seed,
+	    (unsigned long long)(seed + niter - 1));
+}
+
+/*
+ * Micro benchmarks.
+ */
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static int    nsamples;
+static char   **bench_names[3];
+static u_char **samples;
+
+static const char *bench_exts[] = {
+	"jpg", "png", "js", "txt", "html", "c", "h", "py", "pdf", "json",
+	"xml", "tar.gz", "mp3", "css", "gif", "svg", "zip", "docx", "mp4", "sh"
+};
+#define NBENCH_EXTS (sizeof(bench_exts) / sizeof(bench_exts[0]))
+#define NBENCH_NAMES 1000
+
+typedef enum {
+	NAME_HIT, NAME_FOLDED, NAME_MISS
+} name_kind_t;
+
+static char **
+gen_bench_names(name_kind_t kind)
+{
+	int  i;
+	char *p, **names;
+
+	if ((names = malloc(NBENCH_NAMES * sizeof(char *))) == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	for (i = 0; i < NBENCH_NAMES; i++) {
+		if ((names[i] = malloc(32)) == NULL)
+			err(EXIT_FAILURE, "malloc()");
+		if (kind == NAME_MISS) {
+			(void)snprintf(names[i], 32, "file%d.q%d", i,
+			    rnd(1000));
+			continue;
+		}
+		(void)snprintf(names[i], 32, "file%d.%s", i,
+		    bench_exts[rnd(NBENCH_EXTS)]);
+		if (kind == NAME_FOLDED) {
+			for (p = strchr(names[i], '.'); *p != '\0'; p++)
+				*p = toupper((unsigned char)*p);
+		}
+	}
+	return (names);
+}
+
+static double
+bench_glob(void *arg)
+{
+	int    i, n;
+	char   **names = arg;
+	double t;
+
+	for (t = now(), n = 0; n < PERF_OPS; n += NBENCH_NAMES) {
+		for (i = 0; i < NBENCH_NAMES; i++) {
+			if (glob_lookup_mime_type(names[i], false,
+			    NULL) == NULL)
+				(void)glob_lookup_mime_type(names[i], true,
+				    NULL);
+		}
+	}
+	return ((now() - t) * 1e9 / n);
+}
+
+static double
+bench_magic_hit(void *arg)
+{
+	int    i, n;
+	double t;
+
+	for (t = now(), n = 0; n < PERF_MAGIC_OPS; n += nsamples)
+		for (i = 0; i < nsamples; i++)
+			(void)magic_match_buffer(samples[i], PERF_SAMPLE);
+	return ((now() - t) * 1e9 / n);
+}
+
+static double
+bench_magic_miss(void *arg)
+{
+	int    n;
+	double t;
+
+	for (t = now(), n = 0; n < PERF_MAGIC_OPS; n++)
+		(void)magic_match_buffer(content, PERF_SAMPLE);
+	return ((now() - t) * 1e9 / n);
+}
+
+static double
+bench_magic_partial(void *arg)
+{
+	int	   i, n;
+	double	   t;
+	const char *mime;
+
+	for (t = now(), n = 0; n < PERF_PARTIAL_OPS; n += nsamples)
+		for (i = 0; i < nsamples; i++)
+			(void)magic_match_partial(samples[i], 16, &mime);
+	return ((now() - t) * 1e9 / n);
+}
+
+/*
+ * Load the installed MIME database, generate the input of the
+ * benchmarks, and return their number.
+ */
+static int
+init_benchmarks(bench_t *bench)
+{
+	int	   i, n;
+	const char *type;
+
+	rng_state = DEFAULT_SEED;
+	if (dsbmime_init() == -1)
+		errx(EXIT_FAILURE, "Couldn't init mime lib");
+	n = 0;
+	for (i = 0; i < 3; i++)
+		bench_names[i] = gen_bench_names((name_kind_t)i);
+	bench[n].name = "glob_hit";    bench[n].fn = bench_glob;
+	bench[n++].arg = bench_names[NAME_HIT];
+	bench[n].name = "glob_folded"; bench[n].fn = bench_glob;
+	bench[n++].arg = bench_names[NAME_FOLDED];
+	bench[n].name = "glob_miss";   bench[n].fn = bench_glob;
+	bench[n++].arg = bench_names[NAME_MISS];
+
+	nsamples = magic_nsections();
+	if ((samples = malloc(nsamples * sizeof(u_char *))) == NULL)
+		err(EXIT_FAILURE, "malloc()");
+	for (i = 0; i < nsamples; i++) {
+		if ((samples[i] = malloc(PERF_SAMPLE)) == NULL)
+			err(EXIT_FAILURE, "malloc()");
+		if (magic_gen_sample(i, samples[i], PERF_SAMPLE, &type) < 0)
+			errx(EXIT_FAILURE, "magic_gen_sample() failed");
+	}
+	/* Printable text matches (almost) no section. */
+	for (i = 0; i < PERF_SAMPLE; i++)
+		content[i] = i % 64 == 63 ? '\n' : 'a' + rnd(26);
+	bench[n].name = "magic_hit";	 bench[n++].fn = bench_magic_hit;
+	bench[n].name = "magic_miss";	 bench[n++].fn = bench_magic_miss;
+	bench[n].name = "magic_partial"; bench[n++].fn = bench_magic_partial;
+
+	for (i = 0; i < n; i++) {
+		bench[i].ns = bench[i].base = 0;
+		bench[i].measure = true;
+	}
+	return (n);
+}
+
+static void
+cleanup_benchmarks(void)
+{
+	int i, j;
+
+	for (i = 0; i < nsamples; i++)
+		free(samples[i]);
+	free(samples);
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < NBENCH_NAMES; j++)
+			free(bench_names[i][j]);
+		free(bench_names[i]);
+	}
+	dsbmime_cleanup();
+}
+
+/*
+ * Run the benchmarks to measure PERF_RUNS times, and keep the best time
+ * of each. Other processes can only make a run slower. The runs of
+ * different benchmarks take turns, so that a busy phase of the machine
+ * doesn't spoil all runs of one benchmark.
+ */
+static void
+run_benchmarks(bench_t *bench, int n)
+{
+	int    i, run;
+	double ns;
+
+	for (run = 0; run < PERF_RUNS; run++) {
+		for (i = 0; i < n; i++) {
+			if (!bench[i].measure)
+				continue;
+			ns = bench[i].fn(bench[i].arg);
+			if (bench[i].ns == 0 || ns < bench[i].ns)
+				bench[i].ns = ns;
+		}
+	}
+}
+
+/*
+ * Run the benchmarks, and compare the results with the baseline file if
+ * given. Return the number of benchmarks which are more than threshold
+ * percent slower than the baseline.
+ *
+ * A busy phase of the machine can outlast all runs, and make any
+ * benchmark look slower. So the slower ones are measured again after a
+ * pause, up to PERF_RETRIES times, and count only if they stay slower.
+ */
+static int
+perf(const char *baseline, const char *output, int threshold)
+{
+	int	n, i, retry, nregress;
+	char	name[64];
+	FILE	*fp;
+	double	ns;
+	bench_t bench[MAX_BENCH];
+
+	n = init_benchmarks(bench);
+	run_benchmarks(bench, n);
+	if (baseline != NULL) {
+		if ((fp = fopen(baseline, "r")) == NULL)
+			err(EXIT_FAILURE, "fopen(%s)", baseline);
+		while (fscanf(fp, "%63s %lf", name, &ns) == 2) {
+			for (i = 0; i < n; i++) {
+				if (strcmp(name, bench[i].name) == 0)
+					bench[i].base = ns;
+			}
+		}
+		(void)fclose(fp);
+	}
+	for (retry = 0;; retry++) {
+		for (nregress = i = 0; i < n; i++) {
+			bench[i].measure = bench[i].base > 0 && bench[i].ns >
+			    bench[i].base * (100 + threshold) / 100;
+			if (bench[i].measure)
+				nregress++;
+		}
+		if (nregress == 0 || retry == PERF_RETRIES)
+			break;
+		(void)sleep(1);
+		run_benchmarks(bench, n);
+	}
+	cleanup_benchmarks();
+
+	for (i = 0; i < n; i++) {
+		(void)printf("%-16s %10.1f ns/op", bench[i].name, bench[i].ns);
+		if (bench[i].base > 0) {
+			(void)printf(" %10.1f %+7.1f%%", bench[i].base,
+			    (bench[i].ns - bench[i].base) * 100 /
+			    bench[i].base);
+			if (bench[i].measure)
+				(void)printf(" REGRESSION");
+		}
+		(void)putchar('\n');
+	}
+	if (retry > 0)
+		(void)printf("Slower benchmarks measured %d more times\n",
+		    retry);
+	if (output != NULL) {
+		if ((fp = fopen(output, "w")) == NULL)
+			err(EXIT_FAILURE, "fopen(%s)", output);
+		for (i = 0; i < n; i++)
+			(void)fprintf(fp, "%s %.1f\n", bench[i].name,
+			    bench[i].ns);
+		if (fclose(fp) != 0)
+			err(EXIT_FAILURE, "fclose(%s)", output);
+	}
+	return (nregress);
+}
+
+static void
+usage(void)
+{
+	(void)fprintf(stderr,
+	    "Usage: fuzz [-D datadir][-n iterations][-s seed]\n" \
+	    "       fuzz -p [-b baseline][-o output][-T threshold]\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int	   ch, niter, threshold;
+	bool	   pflag;
+	uint64_t   seed;
+	const char *datadir, *baseline, *output;
+
+	pflag = false; datadir = baseline = output = NULL;
+	niter = DEFAULT_ITER; seed = DEFAULT_SEED;
+	threshold = DEFAULT_THRESHOLD;
+	while ((ch = getopt(argc, argv, "b:D:n:o:ps:T:h")) != -1) {
+		switch (ch) {
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'D':
+			datadir = optarg;
+			break;
+		case 'n':
+			if ((niter = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'p':
+			pflag = true;
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'T':
+			if ((threshold = atoi(optarg)) < 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc > optind)
+		usage();
+	if (pflag)
+		return (perf(baseline, output, threshold) > 0 ? EXIT_FAILURE :
+		    EXIT_SUCCESS);
+	fuzz(datadir, seed, niter);
+
+	return (EXIT_SUCCESS);
+}
+#endif
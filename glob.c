@@ -31,24 +31,47 @@
 #include <err.h>
 #include <fnmatch.h>
 #include "glob.h"
+#include "stats.h"
 
 #define M 27		/* A good constant for the hash function. */
+#define NOGLOBS "__NOGLOBS__"
 
+#define NIL	UINT32_MAX
+
+/*
+ * Struct to represent a pattern while loading the globs files.
+ */
 typedef struct glob_s {
-	bool	      hashed;
+	int	      weight;
+	int	      layer;	/* Rank of the data directory */
+	int	      seq;	/* Position in the file */
 	char	      *glob;
 	char	      *mime_type;	
 	struct glob_s *next;
 } glob_t;
 
-typedef struct hash_s {
-	glob_t	      *glob;
-	struct hash_s *next;
-} hash_t;
+/*
+ * Packed form of a pattern, used for lookups. Patterns and MIME types
+ * are stored in the strings array, each MIME type once. Entries with
+ * patterns which can't be looked up by hash come first.
+ */
+typedef struct glob_entry_s {
+	uint32_t glob;		/* Index of the pattern in strings */
+	uint32_t mime;		/* Index of the MIME type in strings */
+	uint32_t next;		/* Next entry in the hash chain, or NIL */
+	int	 weight;
+} glob_entry_t;
+
+static int	    hashsize = 0, init = 0;
+static char	    *strings = NULL;
+static size_t	    strsize = 0;
+static uint32_t	    nentries = 0, npatterns = 0;
+static uint32_t	    *hashtbl = NULL;	/* First entry of each chain */
+static glob_t	    *globlst = NULL;
+static glob_entry_t *entries = NULL;
 
-static int    hashsize = 0, init = 0;
-static hash_t **hashtbl = NULL;
-static glob_t *globlst = NULL;
+#define GLOB(e)	(strings + (e)->glob)
+#define MIME(e)	(strings + (e)->mime)
 
 /*
  * Get the first prime number >= n.
@@ -78,7 +101,7 @@ get_nearest_prime(int n)
 static int
 glob_hash_string(const char *str, bool igncase)
 {
-	static int h;
+	int h;
 
 	for (h = 0; *str != '\0';) {
 		h *= M;
@@ -91,18 +114,25 @@ glob_hash_string(const char *str, bool igncase)
 	return (h);
 }
 
-static glob_t *
-glob_read_file(const char *path)
+/*
+ * Append the patterns of the given globs file to the list. "layer" is
+ * the file's rank in the list of data directories, 0 being the most
+ * important one.
+ */
+static int
+glob_read_file(const char *path, int layer)
 {
 	FILE   *fp;
 	char   *buf, *glob, *mime;
 	glob_t *gp;
 
 	if ((fp = fopen(path, "r")) == NULL)
-		return (NULL);
+		return (-1);
 	if ((buf = malloc(_POSIX2_LINE_MAX)) == NULL) {
-		fclose(fp); return (NULL);
+		fclose(fp); return (-1);
 	}
+	for (gp = globlst; gp != NULL && gp->next != NULL; gp = gp->next)
+		;
 	while (fgets(buf, _POSIX2_LINE_MAX, fp) != NULL) {
 		if (buf[0] == '#' || !isdigit(buf[0]))
 			continue;
@@ -115,24 +145,109 @@ glob_read_file(const char *path)
 		*glob++ = '\0';
 		if (globlst == NULL) {
 			if ((globlst = malloc(sizeof(glob_t))) == NULL) {
-				fclose(fp); free(buf); return (NULL);
+				fclose(fp); free(buf); return (-1);
 			}
 			gp = globlst;
 			gp->next = NULL;
 		} else if ((gp->next = malloc(sizeof(glob_t))) == NULL) {
-			fclose(fp); free(buf); return (NULL);
+			fclose(fp); free(buf); return (-1);
 		} else
 			gp = gp->next;
+		gp->glob = NULL;
+		gp->next = NULL;
 		if ((gp->mime_type = strdup(mime)) == NULL ||
 		    (gp->glob = strdup(glob)) == NULL) {
-			fclose(fp); free(buf); return (NULL);
+			fclose(fp); free(buf); return (-1);
 		}
-		gp->next = NULL;
-		hashsize++;
+		gp->weight = (int)strtol(buf, NULL, 10);
+		gp->layer  = layer;
+		gp->seq	   = hashsize++;
 	}
 	fclose(fp); free(buf);
 
-	return (globlst);
+	return (0);
+}
+
+static void
+glob_free_entry(glob_t *gp)
+{
+	free(gp->glob);
+	free(gp->mime_type);
+	free(gp);
+}
+
+static int
+glob_cmp_type(const void *a, const void *b)
+{
+	int	     ret;
+	const glob_t *ga = *(glob_t * const *)a, *gb = *(glob_t * const *)b;
+
+	if ((ret = strcmp(ga->mime_type, gb->mime_type)) != 0)
+		return (ret);
+	if ((ret = strcmp(ga->glob, gb->glob)) != 0)
+		return (ret);
+	if (ga->layer != gb->layer)
+		return (ga->layer - gb->layer);
+	return (ga->seq - gb->seq);
+}
+
+static int
+glob_cmp_seq(const void *a, const void *b)
+{
+	const glob_t *ga = *(glob_t * const *)a, *gb = *(glob_t * const *)b;
+
+	if (ga->layer != gb->layer)
+		return (ga->layer - gb->layer);
+	return (ga->seq - gb->seq);
+}
+
+/*
+ * Merge the patterns read from the globs files. A pattern defined more
+ * than once, by one or by several files, is kept once, with the weight
+ * of its first definition in the most important file. A __NOGLOBS__
+ * entry removes the patterns of its type defined by less important
+ * files. The list is ordered by layer and position in the file
+ * afterwards, so that the most important file's patterns come first.
+ */
+static int
+glob_merge(void)
+{
+	int    i, j, n, cut;
+	glob_t *gp, *prev, **v;
+
+	if ((v = malloc(sizeof(glob_t *) * (hashsize + 1))) == NULL)
+		return (-1);
+	for (n = 0, gp = globlst; gp != NULL; gp = gp->next)
+		v[n++] = gp;
+	qsort(v, n, sizeof(glob_t *), glob_cmp_type);
+	for (i = 0; i < n; i = j) {
+		/* Find the most important __NOGLOBS__ of this type. */
+		for (cut = INT_MAX, j = i; j < n &&
+		    strcmp(v[j]->mime_type, v[i]->mime_type) == 0; j++) {
+			if (strcmp(v[j]->glob, NOGLOBS) == 0 &&
+			    v[j]->layer < cut)
+				cut = v[j]->layer;
+		}
+		for (prev = NULL; i < j; i++) {
+			if (v[i]->layer > cut ||
+			    strcmp(v[i]->glob, NOGLOBS) == 0 || (prev != NULL &&
+			    strcmp(prev->glob, v[i]->glob) == 0)) {
+				glob_free_entry(v[i]);
+				v[i] = NULL;
+			} else
+				prev = v[i];
+		}
+	}
+	for (i = j = 0; i < n; i++)
+		if (v[i] != NULL)
+			v[j++] = v[i];
+	qsort(v, j, sizeof(glob_t *), glob_cmp_seq);
+	for (v[j] = NULL, hashsize = j, i = 0; i < j; i++)
+		v[i]->next = v[i + 1];
+	globlst = v[0];
+	free(v);
+
+	return (0);
 }
 
 static void
@@ -142,89 +257,135 @@ glob_free_list(void)
 
 	for (gp = globlst; gp != NULL; gp = next_gp) {
 		next_gp = gp->next;
-		free(gp->glob);
-		free(gp->mime_type);
-		free(gp);
+		glob_free_entry(gp);
 	}
 	globlst = NULL;
 }
 
-static hash_t **
-glob_gen_hashtbl(void)
+/*
+ * Return true if the pattern has the form "*.ext", where ext has no
+ * wildcards, so it can be looked up by hashing the file name extension.
+ */
+static bool
+glob_is_hashed(const char *glob)
+{
+	if (glob[0] != '*' || glob[1] != '.')
+		return (false);
+	return (strpbrk(glob + 2, "*?[") == NULL);
+}
+
+static int
+glob_cmp_mime(const void *a, const void *b)
 {
-	int    hash, i;
-	char   *p, *q;
-	glob_t *gp;
-	hash_t *hp;
+	const glob_t *ga = *(glob_t * const *)a, *gb = *(glob_t * const *)b;
 
-	hashsize = get_nearest_prime(hashsize);
-	if ((hashtbl = malloc(sizeof(hash_t *) * hashsize)) == NULL)
-		return (NULL);
-	for (i = 0; i < hashsize; i++)
-		hashtbl[i] = NULL;
-	for (gp = globlst; gp != NULL; gp = gp->next) {
-		if (gp->glob[0] != '*' || gp->glob[1] != '.')
-			continue;
-		for (q = p = gp->glob + 2; *p != '\0'; p++)
-			if (strchr("*?[", *p) != NULL)
-				break;
-		if (*p != '\0') {
-			gp->hashed = false;
-			continue;
-		}
-		hash = glob_hash_string(q, false);
-		gp->hashed = true;
-
-		if (hashtbl[hash] == NULL) {
-			hashtbl[hash] = malloc(sizeof(hash_t));
-			hashtbl[hash]->next = NULL;
-			hashtbl[hash]->glob = gp;
-		} else {
-			for (hp = hashtbl[hash]; hp->next != NULL;
-			    hp = hp->next)
-				;
-			hp->next = malloc(sizeof(hash_t));
-			hp = hp->next;
-			hp->next = NULL;
-			hp->glob = gp;
+	return (strcmp(ga->mime_type, gb->mime_type));
+}
+
+/*
+ * Convert the list of patterns into the packed entries and hash table,
+ * and free the list.
+ */
+static int
+glob_pack(void)
+{
+	int	 i, n;
+	char	 *mime;
+	size_t	 len;
+	glob_t	 *gp, **v;
+	uint32_t hash;
+
+	for (n = 0, gp = globlst; gp != NULL; gp = gp->next)
+		n++;
+	if ((v = malloc(sizeof(glob_t *) * (n + 1))) == NULL)
+		return (-1);
+	/* Unhashed patterns first, keeping the order within both parts. */
+	for (i = 0, gp = globlst; gp != NULL; gp = gp->next)
+		if (!glob_is_hashed(gp->glob))
+			v[i++] = gp;
+	for (npatterns = i, gp = globlst; gp != NULL; gp = gp->next)
+		if (glob_is_hashed(gp->glob))
+			v[i++] = gp;
+	/* Remember each pattern's entry, and sort by type for sharing. */
+	for (strsize = i = 0; i < n; i++) {
+		v[i]->seq = i;
+		strsize += strlen(v[i]->glob) + 1;
+	}
+	qsort(v, n, sizeof(glob_t *), glob_cmp_mime);
+	for (i = 0; i < n; i++)
+		if (i == 0 || strcmp(v[i]->mime_type, v[i - 1]->mime_type) != 0)
+			strsize += strlen(v[i]->mime_type) + 1;
+	hashsize = get_nearest_prime(n);
+	entries = malloc(sizeof(glob_entry_t) * (n > 0 ? n : 1));
+	strings = malloc(strsize > 0 ? strsize : 1);
+	hashtbl = malloc(sizeof(uint32_t) * hashsize);
+	if (entries == NULL || strings == NULL || hashtbl == NULL) {
+		free(v);
+		return (-1);
+	}
+	for (mime = strings, len = i = 0; i < n; i++) {
+		if (i == 0 || strcmp(v[i]->mime_type, v[i - 1]->mime_type)) {
+			mime = strings + len;
+			(void)strcpy(mime, v[i]->mime_type);
+			len += strlen(mime) + 1;
 		}
+		entries[v[i]->seq].mime	  = mime - strings;
+		entries[v[i]->seq].glob	  = len;
+		entries[v[i]->seq].weight = v[i]->weight;
+		(void)strcpy(strings + len, v[i]->glob);
+		len += strlen(v[i]->glob) + 1;
 	}
-	return (hashtbl);
+	free(v);
+	for (i = 0; i < hashsize; i++)
+		hashtbl[i] = NIL;
+	/* Prepend in reverse order, so the chains are in list order. */
+	for (nentries = n, i = n - 1; i >= (int)npatterns; i--) {
+		hash = glob_hash_string(GLOB(&entries[i]) + 2, false);
+		entries[i].next = hashtbl[hash];
+		hashtbl[hash] = i;
+	}
+	glob_free_list();
+
+	return (0);
 }
 
 static void
-glob_free_hashtbl(void)
+glob_free_entries(void)
 {
-	int    i;
-	hash_t *hp, *next_hp;
-
-	if (hashtbl == NULL)
-		return;
-	for (i = 0; i < hashsize; i++)
-		for (hp = hashtbl[i]; hp != NULL; hp = next_hp) {
-			next_hp = hp->next; free(hp);
-		}
-	free(hashtbl); hashtbl = NULL;
+	free(entries); free(strings); free(hashtbl);
+	entries = NULL; strings = NULL; hashtbl = NULL;
+	nentries = npatterns = hashsize = 0; strsize = 0;
 }
 
+/*
+ * Load the given globs files, ordered from the most to the least
+ * important one, into a single index.
+ */
 int
-glob_init(const char *globpath)
+glob_init(char *const *paths, int npaths)
 {
+	int i;
+
 	if (init != 0)
 		return (-1);
-	globlst = NULL; hashtbl = NULL; hashsize = 0;
+	globlst = NULL; hashsize = 0;
 
-	if (glob_read_file(globpath) == NULL) {
-		if (errno != 0)
-			warn("glob_read_file(%s)", globpath);
+	for (i = npaths - 1; i >= 0; i--) {
+		if (glob_read_file(paths[i], i) == -1) {
+			warn("glob_read_file(%s)", paths[i]);
+			glob_free_list();
+			return (-1);
+		}
+	}
+	if (glob_merge() == -1) {
+		warn("glob_merge()");
 		glob_free_list();
 		return (-1);
 	}
-	if (glob_gen_hashtbl() == NULL) {
-		if (errno != 0)
-			warn("glob_gen_hashtbl()");
-		if (hashtbl != NULL)
-			glob_free_hashtbl();
+	if (glob_pack() == -1) {
+		warn("glob_pack()");
+		glob_free_entries();
+		glob_free_list();
 		return (-1);
 	}
 	init = 1;
@@ -236,43 +397,135 @@ glob_cleanup(void)
 {
 	if (init == 0)
 		return;
-	glob_free_hashtbl();
-	glob_free_list();
+	glob_free_entries();
 	init = 0;
 }
 
+/*
+ * Return true if the pattern's extension equals the file name extension
+ * with upper case letters folded. The hash of the folded extension only
+ * leads to patterns in lower case.
+ */
+static bool
+glob_folded_equal(const char *ext, const char *p)
+{
+	for (; *ext != '\0' && *p != '\0'; ext++, p++)
+		if (*ext != tolower((unsigned char)*p))
+			return (false);
+	return (*ext == *p);
+}
+
+/*
+ * Look up the MIME type of the given file name. If weight is not NULL,
+ * the weight of the matching pattern is stored in *weight.
+ */
 const char *
-glob_lookup_mime_type(const char *filename, bool igncase)
+glob_lookup_mime_type(const char *filename, bool igncase, int *weight)
 {
-	int	   hash, matches;
-	glob_t	   *gp;
-	hash_t	   *hp;
-	const char *p;
+	int		   hash, matches;
+	uint32_t	   i;
+	const char	   *p;
+	const glob_entry_t *gp;
+	STATS_TIMER(t);
 
+	if (init == 0)
+		return (NULL);
+	STATS_START(t);
 	for (matches = 0, gp = NULL, p = filename;
 	    (p = strchr(p, '.')) != NULL && matches == 0;) {
 		hash = glob_hash_string(++p, igncase);
-		for (hp = hashtbl[hash]; hp != NULL; hp = hp->next)
-			/* Skip '*.' in hp->glob->glob. */
-			if (!igncase && strcmp(hp->glob->glob + 2, p) == 0) {
-				/* Try a case sensitive match. */
-				gp = hp->glob; matches++;
-			} else if (strcasecmp(hp->glob->glob + 2, p) == 0) {
-				gp = hp->glob; matches++;
-			}
-	}	
+		for (i = hashtbl[hash]; i != NIL; i = entries[i].next) {
+			/*
+			 * Skip '*.' in the pattern. Other patterns in the
+			 * chain only share the hash value.
+			 */
+			if (!(igncase ? glob_folded_equal(GLOB(&entries[i]) +
+			    2, p) : strcmp(GLOB(&entries[i]) + 2, p) == 0))
+				continue;
+			/* Only matches of the highest weight count. */
+			if (gp == NULL || entries[i].weight > gp->weight) {
+				gp = &entries[i]; matches = 1;
+			} else if (entries[i].weight == gp->weight)
+				matches++;
+		}
+	}
+	STATS_STOP(t, igncase ? DSBMIME_STAGE_GLOB_FOLDED :
+	    DSBMIME_STAGE_GLOB_EXACT);
 	if (matches > 1)
-		/* Match is ambiguous. */
+		/* Several matches of the same weight are ambiguous. */
 		return (NULL);
 	else if (matches == 0) {
 		/* No match - Try to find mime type by using fnmatch(). */
-		for (gp = globlst; gp != NULL; gp = gp->next)
-			if (!gp->hashed)
-				if (!fnmatch(gp->glob, filename, FNM_NOESCAPE))
-					return (gp->mime_type);
-		return (NULL);
+		STATS_START(t);
+		for (gp = NULL, i = 0; i < npatterns && gp == NULL; i++)
+			if (!fnmatch(GLOB(&entries[i]), filename, FNM_NOESCAPE))
+				gp = &entries[i];
+		STATS_STOP(t, DSBMIME_STAGE_GLOB_PATTERN);
+		if (gp == NULL)
+			return (NULL);
+		STATS_INC(hits[DSBMIME_STAGE_GLOB_PATTERN]);
+		if (weight != NULL)
+			*weight = gp->weight;
+		return (MIME(gp));
 	}
 	/* Unique match. */
-	return (gp->mime_type);
+	STATS_INC(hits[igncase ? DSBMIME_STAGE_GLOB_FOLDED :
+	    DSBMIME_STAGE_GLOB_EXACT]);
+	if (weight != NULL)
+		*weight = gp->weight;
+	return (MIME(gp));
+}
+
+static int
+glob_add_candidate(const glob_entry_t *gp, dsbmime_candidate_t *cand, int i,
+    int n)
+{
+	if (i >= n)
+		return (i);
+	cand[i].type   = MIME(gp);
+	cand[i].source = DSBMIME_SOURCE_GLOB;
+	cand[i].score  = gp->weight;
+
+	return (i + 1);
+}
+
+/*
+ * Store the MIME types of up to n patterns matching the given file name
+ * in cand, and return their number. Unlike glob_lookup_mime_type(), all
+ * extensions and patterns are tried, and all matches are returned.
+ */
+int
+glob_lookup_all(const char *filename, dsbmime_candidate_t *cand, int n)
+{
+	int	   i, hash, folded;
+	uint32_t   e;
+	const char *p;
+
+	if (init == 0)
+		return (0);
+	for (i = 0, p = filename; (p = strchr(p, '.')) != NULL;) {
+		hash = glob_hash_string(++p, false);
+		for (e = hashtbl[hash]; e != NIL; e = entries[e].next)
+			if (strcasecmp(GLOB(&entries[e]) + 2, p) == 0)
+				i = glob_add_candidate(&entries[e], cand, i, n);
+		if ((folded = glob_hash_string(p, true)) == hash)
+			continue;
+		for (e = hashtbl[folded]; e != NIL; e = entries[e].next)
+			if (strcasecmp(GLOB(&entries[e]) + 2, p) == 0)
+				i = glob_add_candidate(&entries[e], cand, i, n);
+	}
+	for (e = 0; e < npatterns; e++)
+		if (!fnmatch(GLOB(&entries[e]), filename, FNM_NOESCAPE))
+			i = glob_add_candidate(&entries[e], cand, i, n);
+	return (i);
 }
 
+/*
+ * Return the number of bytes allocated for the patterns.
+ */
+size_t
+glob_memory_usage(void)
+{
+	return (nentries * sizeof(glob_entry_t) + strsize +
+	    hashsize * sizeof(uint32_t));
+}
@@ -26,12 +26,18 @@
 #define _GLOB_H_
 
 #include <stdbool.h>
+#include "dsbmime.h"
 
 #define PATH_GLOBS "mime/globs2"
 
-extern int	  glob_init(const char *);
+/* Weight of patterns the database doesn't specify a weight for. */
+#define GLOB_DEFAULT_WEIGHT 50
+
+extern int	  glob_init(char *const *, int);
+extern int	  glob_lookup_all(const char *, dsbmime_candidate_t *, int);
 extern void	  glob_cleanup(void);
-extern const char *glob_lookup_mime_type(const char *, bool);
+extern size_t	  glob_memory_usage(void);
+extern const char *glob_lookup_mime_type(const char *, bool, int *);
 
 #endif	/* ! _GLOB_H_ */
 
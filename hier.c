@@ -0,0 +1,403 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * MIME type hierarchy from shared-mime-info's subclasses and aliases
+ * files. Aliases are resolved to their canonical types while loading.
+ * Every canonical type gets a bitset of all its ancestors, so that
+ * "is type a subclass of parent?" takes two hash lookups and a bit
+ * test.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/types.h>
+#include "hier.h"
+
+#define TYPE_TEXT   "text/plain"
+#define TYPE_BINARY "application/octet-stream"
+
+typedef struct hier_entry_s {
+	char *name;
+	int  id;		/* Index of the (canonical) type */
+} hier_entry_t;
+
+typedef struct hier_edge_s {
+	int child, parent;
+} hier_edge_t;
+
+static int	    init = 0;
+static int	    ntypes = 0, nwords = 0, nentries = 0, tblsize = 0;
+static int	    nedges = 0, edgesize = 0;
+static size_t	    namesize = 0;	/* Bytes used by the names */
+static char	    **types = NULL;	/* Canonical names by id */
+static uint64_t	    *ancestors = NULL;	/* ntypes x nwords bitsets */
+static hier_edge_t  *edges = NULL;
+static hier_entry_t *tbl = NULL;	/* Open addressing, tblsize = 2^n */
+
+static u_int
+hier_hash_string(const char *str)
+{
+	u_int h;
+
+	/* FNV-1a */
+	for (h = 2166136261U; *str != '\0'; str++)
+		h = (h ^ (u_char)*str) * 16777619U;
+	return (h);
+}
+
+static hier_entry_t *
+hier_find(const char *name)
+{
+	u_int i;
+
+	if (tbl == NULL)
+		return (NULL);
+	for (i = hier_hash_string(name) & (tblsize - 1); tbl[i].name != NULL;
+	    i = (i + 1) & (tblsize - 1)) {
+		if (strcmp(tbl[i].name, name) == 0)
+			return (&tbl[i]);
+	}
+	return (NULL);
+}
+
+static int
+hier_grow_table(void)
+{
+	int	     i, size;
+	u_int	     j;
+	hier_entry_t *p;
+
+	size = tblsize == 0 ? 256 : tblsize * 2;
+	if ((p = calloc(size, sizeof(hier_entry_t))) == NULL)
+		return (-1);
+	for (i = 0; i < tblsize; i++) {
+		if (tbl[i].name == NULL)
+			continue;
+		for (j = hier_hash_string(tbl[i].name) & (size - 1);
+		    p[j].name != NULL; j = (j + 1) & (size - 1))
+			;
+		p[j] = tbl[i];
+	}
+	free(tbl);
+	tbl = p; tblsize = size;
+
+	return (0);
+}
+
+/*
+ * Add name to the table. If canon is -1, name is a new canonical type,
+ * else an alias of the type with id canon. Return the entry.
+ */
+static hier_entry_t *
+hier_add(const char *name, int canon)
+{
+	u_int i;
+	char  **p;
+
+	if ((nentries + 1) * 2 > tblsize && hier_grow_table() == -1)
+		return (NULL);
+	if (canon == -1) {
+		p = realloc(types, (ntypes + 1) * sizeof(char *));
+		if (p == NULL)
+			return (NULL);
+		types = p;
+	}
+	for (i = hier_hash_string(name) & (tblsize - 1); tbl[i].name != NULL;
+	    i = (i + 1) & (tblsize - 1))
+		;
+	if ((tbl[i].name = strdup(name)) == NULL)
+		return (NULL);
+	namesize += strlen(name) + 1;
+	nentries++;
+	if (canon != -1)
+		tbl[i].id = canon;
+	else {
+		types[ntypes] = tbl[i].name;
+		tbl[i].id = ntypes++;
+	}
+	return (&tbl[i]);
+}
+
+/*
+ * Return the id of the given type, resolving aliases. Add the type if
+ * it doesn't exist.
+ */
+static int
+hier_intern(const char *name)
+{
+	hier_entry_t *ep;
+
+	if ((ep = hier_find(name)) == NULL && (ep = hier_add(name, -1)) == NULL)
+		return (-1);
+	return (ep->id);
+}
+
+static int
+hier_add_edge(int child, int parent)
+{
+	hier_edge_t *p;
+
+	if (child == parent)
+		return (0);
+	if (nedges == edgesize) {
+		edgesize = edgesize == 0 ? 512 : edgesize * 2;
+		if ((p = realloc(edges, edgesize * sizeof(hier_edge_t))) == NULL)
+			return (-1);
+		edges = p;
+	}
+	edges[nedges].child = child; edges[nedges++].parent = parent;
+
+	return (0);
+}
+
+/*
+ * Read a file with lines of the form "<type> <type>", and call fn for
+ * each pair. A missing file is not an error.
+ */
+static int
+hier_read_file(const char *path, int (*fn)(const char *, const char *))
+{
+	FILE *fp;
+	char *buf, *p, *q;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (errno == ENOENT ? 0 : -1);
+	if ((buf = malloc(_POSIX2_LINE_MAX)) == NULL) {
+		(void)fclose(fp); return (-1);
+	}
+	while (fgets(buf, _POSIX2_LINE_MAX, fp) != NULL) {
+		if (buf[0] == '#')
+			continue;
+		(void)strtok(buf, "\n");
+		if ((q = strchr(buf, ' ')) == NULL)
+			continue;
+		*q++ = '\0';
+		if ((p = strchr(q, ' ')) != NULL)
+			*p = '\0';
+		if (fn(buf, q) == -1) {
+			(void)fclose(fp); free(buf); return (-1);
+		}
+	}
+	(void)fclose(fp); free(buf);
+
+	return (0);
+}
+
+static int
+hier_add_alias(const char *alias, const char *canon)
+{
+	int	     id;
+	hier_entry_t *ep;
+
+	if ((id = hier_intern(canon)) == -1)
+		return (-1);
+	if ((ep = hier_find(alias)) != NULL) {
+		/* Already known. The first definition wins. */
+		return (0);
+	}
+	return (hier_add(alias, id) == NULL ? -1 : 0);
+}
+
+static int
+hier_add_subclass(const char *child, const char *parent)
+{
+	int c, p;
+
+	if ((c = hier_intern(child)) == -1 || (p = hier_intern(parent)) == -1)
+		return (-1);
+	return (hier_add_edge(c, p));
+}
+
+#define ANCESTORS(id)	   (ancestors + (size_t)(id) * nwords)
+#define SET_BIT(set, bit)  ((set)[(bit) / 64] |= (uint64_t)1 << ((bit) % 64))
+#define TEST_BIT(set, bit) ((set)[(bit) / 64] & ((uint64_t)1 << ((bit) % 64)))
+
+/*
+ * Compute the ancestor set of the given type. "state" is 0 for types
+ * not visited yet, 1 for types being visited, and 2 for types done.
+ * Edges are sorted by child.
+ */
+static void
+hier_close(int id, u_char *state, const int *first)
+{
+	int	 e, i, p;
+	uint64_t *set;
+
+	if (state[id] != 0)
+		/* Done, or a cycle. */
+		return;
+	state[id] = 1;
+	set = ANCESTORS(id);
+	for (e = first[id]; e < first[id + 1]; e++) {
+		p = edges[e].parent;
+		hier_close(p, state, first);
+		SET_BIT(set, p);
+		for (i = 0; i < nwords; i++)
+			set[i] |= ANCESTORS(p)[i];
+	}
+	state[id] = 2;
+}
+
+static int
+hier_cmp_edges(const void *a, const void *b)
+{
+	return (((const hier_edge_t *)a)->child -
+	    ((const hier_edge_t *)b)->child);
+}
+
+/*
+ * Add the implicit subclass relations from the shared-mime-info spec:
+ * text/ types are text/plain, and everything except inode/ types is
+ * application/octet-stream. Then compute the ancestor sets.
+ */
+static int
+hier_gen_ancestors(void)
+{
+	int    i, n, text, binary, *first;
+	u_char *state;
+
+	if ((text = hier_intern(TYPE_TEXT)) == -1 ||
+	    (binary = hier_intern(TYPE_BINARY)) == -1)
+		return (-1);
+	for (i = 0, n = ntypes; i < n; i++) {
+		if (strncmp(types[i], "text/", 5) == 0 &&
+		    hier_add_edge(i, text) == -1)
+			return (-1);
+		if (strncmp(types[i], "inode/", 6) != 0 &&
+		    hier_add_edge(i, binary) == -1)
+			return (-1);
+	}
+	qsort(edges, nedges, sizeof(hier_edge_t), hier_cmp_edges);
+	nwords = (ntypes + 63) / 64;
+	ancestors = calloc((size_t)ntypes * nwords, sizeof(uint64_t));
+	first = malloc((ntypes + 1) * sizeof(int));
+	state = calloc(ntypes, 1);
+	if (ancestors == NULL || first == NULL || state == NULL) {
+		free(first); free(state); return (-1);
+	}
+	for (i = n = 0; i <= ntypes; i++) {
+		while (n < nedges && edges[n].child < i)
+			n++;
+		first[i] = n;
+	}
+	for (i = 0; i < ntypes; i++)
+		hier_close(i, state, first);
+	free(first); free(state);
+	free(edges); edges = NULL; nedges = edgesize = 0;
+
+	return (0);
+}
+
+/*
+ * Load the given subclasses and aliases files, ordered from the most to
+ * the least important data directory. Subclass relations of all files
+ * are combined. For aliases, the most important definition wins.
+ */
+int
+hier_init(char *const *subclasses, char *const *aliases, int n)
+{
+	int  i;
+	bool error;
+
+	if (init != 0)
+		return (-1);
+	init = 1;
+	/* Aliases first, so subclass relations can be resolved. */
+	for (error = false, i = 0; i < n && !error; i++)
+		error = hier_read_file(aliases[i], hier_add_alias) == -1;
+	for (i = 0; i < n && !error; i++)
+		error = hier_read_file(subclasses[i], hier_add_subclass) == -1;
+	if (error || hier_gen_ancestors() == -1) {
+		warn("%s: hier_init()", LIBNAME);
+		hier_cleanup();
+		return (-1);
+	}
+	return (0);
+}
+
+void
+hier_cleanup(void)
+{
+	int i;
+
+	if (init == 0)
+		return;
+	for (i = 0; i < tblsize; i++)
+		free(tbl[i].name);
+	free(tbl); free(types); free(ancestors); free(edges);
+	tbl = NULL; types = NULL; ancestors = NULL; edges = NULL;
+	ntypes = nwords = nentries = tblsize = nedges = edgesize = 0;
+	namesize = 0;
+	init = 0;
+}
+
+const char *
+hier_canonical(const char *type)
+{
+	hier_entry_t *ep;
+
+	if ((ep = hier_find(type)) == NULL)
+		return (type);
+	return (types[ep->id]);
+}
+
+bool
+hier_is_a(const char *type, const char *parent)
+{
+	hier_entry_t *tp, *pp;
+
+	tp = hier_find(type); pp = hier_find(parent);
+	if (tp != NULL && pp != NULL) {
+		return (tp->id == pp->id ||
+		    TEST_BIT(ANCESTORS(tp->id), pp->id) != 0);
+	}
+	/* Unknown types only have the implicit parents. */
+	if (tp != NULL)
+		type = types[tp->id];
+	if (pp != NULL)
+		parent = types[pp->id];
+	if (strcmp(type, parent) == 0)
+		return (true);
+	if (strcmp(parent, TYPE_TEXT) == 0)
+		return (strncmp(type, "text/", 5) == 0);
+	if (strcmp(parent, TYPE_BINARY) == 0)
+		return (strncmp(type, "inode/", 6) != 0);
+	return (false);
+}
+
+/*
+ * Return the number of bytes allocated for the type hierarchy.
+ */
+size_t
+hier_memory_usage(void)
+{
+	return (tblsize * sizeof(hier_entry_t) + ntypes * sizeof(char *) +
+	    (size_t)ntypes * nwords * sizeof(uint64_t) + namesize);
+}
@@ -22,26 +22,19 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <err.h>
-#include <dsbmime.h>
+#ifndef _HIER_H_
+#define _HIER_H_
 
-int
-main(int argc, char *argv[])
-{
-	const char *p;
+#include <stddef.h>
+#include <stdbool.h>
 
-	if (argc < 2) {
-		(void)printf("Usage: test file ...\n");
-		return (EXIT_FAILURE);
-	}
-	if (dsbmime_init() == -1)
-		errx(EXIT_FAILURE, "Couldn't init mime lib");
-	while (--argc > 0) {
-		if ((p = dsbmime_get_type(*++argv)) != NULL)
-			(void)printf("%s: %s\n", *argv, p);
-	}
-	return (EXIT_SUCCESS);
-}
+#define PATH_SUBCLASSES "mime/subclasses"
+#define PATH_ALIASES	"mime/aliases"
 
+extern int	  hier_init(char *const *, char *const *, int);
+extern bool	  hier_is_a(const char *, const char *);
+extern void	  hier_cleanup(void);
+extern size_t	  hier_memory_usage(void);
+extern const char *hier_canonical(const char *);
+
+#endif	/* !_HIER_H_ */
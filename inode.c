@@ -0,0 +1,70 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "inode.h"
+#include "stats.h"
+
+/*
+ * Determine the MIME type of special and empty files by stat(), so that
+ * they are never opened. Opening a FIFO would block, and there's nothing
+ * to read from an empty file. Symbolic links are followed, and only
+ * dangling links are reported as such. Return NULL for non-empty regular
+ * files, and if the file doesn't exist.
+ */
+const char *
+inode_lookup_mime_type(const char *file)
+{
+	struct stat sb;
+	const char  *mime;
+	STATS_TIMER(t);
+
+	STATS_START(t);
+	if (stat(file, &sb) == -1) {
+		/* Only look at the link itself if its target is missing. */
+		if (lstat(file, &sb) == 0 && S_ISLNK(sb.st_mode))
+			mime = "inode/symlink";
+		else
+			mime = NULL;
+	} else if (S_ISREG(sb.st_mode))
+		mime = sb.st_size == 0 ? MIME_TYPE_ZEROSIZE : NULL;
+	else if (S_ISDIR(sb.st_mode))
+		mime = "inode/directory";
+	else if (S_ISFIFO(sb.st_mode))
+		mime = "inode/fifo";
+	else if (S_ISSOCK(sb.st_mode))
+		mime = "inode/socket";
+	else if (S_ISCHR(sb.st_mode))
+		mime = "inode/chardevice";
+	else if (S_ISBLK(sb.st_mode))
+		mime = "inode/blockdevice";
+	else
+		mime = NULL;
+	STATS_STOP(t, DSBMIME_STAGE_INODE);
+	if (mime != NULL)
+		STATS_INC(hits[DSBMIME_STAGE_INODE]);
+	return (mime);
+}
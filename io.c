@@ -0,0 +1,157 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * File access for the content stages. Depending on the settings made by
+ * dsbmime_set_io(), reads are rounded up to a multiple of the given
+ * alignment, the kernel's readahead is disabled, and the pages read are
+ * dropped from the page cache afterwards.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include "io.h"
+
+#define IO_FLAGS (DSBMIME_IO_NOREADAHEAD | DSBMIME_IO_DONTNEED)
+
+static dsbmime_io_t io_conf;
+
+int
+io_configure(const dsbmime_io_t *conf)
+{
+	/* The alignment must be a power of 2. */
+	if ((conf->flags & ~IO_FLAGS) != 0 || conf->prefetch < 0 ||
+	    (conf->align & (conf->align - 1)) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	io_conf = *conf;
+
+	return (0);
+}
+
+int
+io_prefetch_depth(void)
+{
+	return (io_conf.prefetch);
+}
+
+/*
+ * Return the number of bytes to request for reading the first size
+ * bytes of a file.
+ */
+size_t
+io_read_size(size_t size)
+{
+	size_t align = io_conf.align;
+
+	return (align > 0 ? (size + align - 1) & ~(align - 1) : size);
+}
+
+int
+io_open(const char *file)
+{
+	int fd, flags;
+
+	/*
+	 * O_NONBLOCK keeps us from hanging if the file was replaced by a
+	 * FIFO after we checked its type.
+	 */
+	flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+#ifdef O_NOATIME
+	/* O_NOATIME is only permitted to the file's owner. */
+	if ((fd = open(file, flags | O_NOATIME)) == -1 && errno == EPERM)
+		fd = open(file, flags);
+#else
+	fd = open(file, flags);
+#endif
+#ifdef POSIX_FADV_RANDOM
+	if (fd != -1 && (io_conf.flags & DSBMIME_IO_NOREADAHEAD))
+		(void)posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+	return (fd);
+}
+
+void
+io_close(int fd)
+{
+	int saved_errno = errno;
+
+	(void)close(fd);
+	errno = saved_errno;
+}
+
+/*
+ * Read up to len bytes at the given offset. Return the number of bytes
+ * read, or -1 if an error occurred.
+ */
+ssize_t
+io_pread(int fd, void *buf, size_t len, off_t offset)
+{
+	size_t	total;
+	ssize_t n;
+
+	for (total = 0; total < len; total += n) {
+		n = pread(fd, (char *)buf + total, len - total, offset + total);
+		if (n == -1 && errno == EINTR)
+			n = 0;
+		else if (n == -1)
+			return (-1);
+		else if (n == 0)
+			break;
+	}
+#ifdef POSIX_FADV_DONTNEED
+	/* Drop the range io_prefetch() asked for, rounded the same way. */
+	if (total > 0 && (io_conf.flags & DSBMIME_IO_DONTNEED)) {
+		(void)posix_fadvise(fd, offset, io_read_size(total),
+		    POSIX_FADV_DONTNEED);
+	}
+#endif
+	return ((ssize_t)total);
+}
+
+/*
+ * Open the given regular file, and ask the kernel to read its first
+ * size bytes, rounded up by io_read_size(), in the background. Return
+ * the file descriptor for reading them, or -1 with errno set if the file
+ * can't be opened.
+ */
+int
+io_prefetch(const char *file, size_t size)
+{
+	int fd;
+
+	if ((fd = io_open(file)) == -1)
+		return (-1);
+#ifdef POSIX_FADV_WILLNEED
+	(void)posix_fadvise(fd, 0, io_read_size(size), POSIX_FADV_WILLNEED);
+#else
+	(void)size;
+#endif
+	return (fd);
+}
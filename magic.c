@@ -28,13 +28,22 @@
 #include <ctype.h>
 #include <limits.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 #ifdef __linux__
 # include <arpa/inet.h>
 #endif
 #include <err.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "magic.h"
+#include "stats.h"
+#include "io.h"
 
 #define MAGICSTR "MIME-Magic\0\n"
+#define NOMAGIC	 "__NOMAGIC__"
 
 typedef struct magic_section_header_s {
 	char	*mime_type;
@@ -42,28 +51,56 @@ typedef struct magic_section_header_s {
 } magic_section_header_t;
 
 /*
- * Struct to represent a magic section record.
+ * Struct to represent a magic section record. The records of a section
+ * are stored one after another in the records array. The value, and the
+ * mask if there is one, follow each other in the blob at index "data".
  */
 typedef struct magic_section_record_s {
-	int	rangelen;
-	int	offset;
-	char	wsize;
-	char	indent;
-	u_char	*val;
-	u_char	*mask;
-	u_short vlen;
-	struct magic_section_record_s *next;
+	int32_t	 offset;
+	uint32_t data;
+	uint16_t vlen;
+	uint16_t rangelen;
+	char	 wsize;
+	char	 indent;
+	bool	 hasmask;
 } magic_section_record_t;
 
 /*
- * Struct to represent a magic file section.
+ * Struct to represent a magic file section. The sections are stored one
+ * after another in the sections array, in file order. The order array
+ * holds their indices in the order they are tested.
  */
 typedef struct magic_section_s {
-	magic_section_header_t *hdr;
-	magic_section_record_t *rec;
-	struct magic_section_s *next;
+	uint32_t mime;		/* Index of the MIME type in blob */
+	uint32_t rec;		/* Index of the first record */
+	uint16_t nrec;		/* # of records */
+	u_short	 prio;
 } magic_section_t;
 
+/*
+ * Counters for the adaptive mode. They are kept in an array of their
+ * own, parallel to the sections array, so that the sections stay small
+ * for the matching loop.
+ */
+typedef struct magic_counter_s {
+	uint32_t hits;		/* # of matches */
+	uint32_t tests;		/* # of times tested */
+	uint64_t cost;		/* # of bytes examined */
+} magic_counter_t;
+
+/*
+ * Struct to represent a run of sections with equal priority. Within
+ * a group, the adaptive mode may reorder sections as long as every
+ * pair of sections which are not provably disjoint keeps its relative
+ * order. This guarantees that the first match is the same as in file
+ * order.
+ */
+typedef struct magic_group_s {
+	int	 nsec;
+	uint32_t first;		/* Index of the first section */
+	u_char	 *disjoint;	/* nsec x nsec bit matrix */
+} magic_group_t;
+
 typedef struct magic_record_s {
 #define MAGIC_TYPE_RECORD 0x1
 #define MAGIC_TYPE_HEADER 0x2
@@ -72,13 +109,37 @@ typedef struct magic_record_s {
 		magic_section_header_t shdr;
 		magic_section_record_t srec;
 	} rec;
+	u_char *val;	/* Value and mask of a section record */
+	u_char *mask;
 } magic_record_t;
 
 extern uint16_t htons(uint16_t);
 
 static int	       buflen = 0, init = 0;
+static int	       ngroups = 0;
+static int	       maxextent = 0;		/* Bytes needed for matching */
+static u_int	       adapt_interval = 0;
+static uint32_t	       adapt_count = 0;
 static u_char	       *buf = NULL;		/* General purpose buffer. */
-static magic_section_t *magic_sections;
+static u_char	       *blob = NULL;		/* Values, masks, MIME types */
+static uint32_t	       bloblen = 0, blobsize = 0;
+static uint32_t	       nrecords = 0, recsize = 0, nsections = 0;
+static uint32_t	       secsize = 0, ntypes = 0, typesize = 0;
+static uint32_t	       *mimetypes = NULL;	/* Sorted types with sections */
+static uint32_t	       *order = NULL;		/* Sections in test order */
+static int	       *layers = NULL;		/* Layers while loading */
+static magic_section_record_t *records = NULL;
+static magic_group_t   *groups = NULL;
+static magic_section_t *sections = NULL;
+static magic_counter_t *counters = NULL;
+static pthread_rwlock_t order_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define SEC_MIME(sec)	  ((const char *)blob + (sec)->mime)
+#define SEC_FIRST(sec)	  (records + (sec)->rec)
+#define SEC_END(sec)	  (records + (sec)->rec + (sec)->nrec)
+#define REC_VAL(r)	  (blob + (r)->data)
+#define REC_MASK(r, n)	  ((r)->hasmask ? blob[(r)->data + (r)->vlen + (n)] : \
+			      0xff)
 
 static u_char *
 extend_buffer(size_t n)
@@ -101,107 +162,190 @@ free_buffer(void)
 	buf = NULL; buflen = 0;
 }
 
+/*
+ * Match the given records against the file's first len bytes. Bytes
+ * beyond the end of the file never match. *cost is set to the number of
+ * bytes compared.
+ */
 static bool
-magic_match_record(FILE *fp, magic_section_record_t *rec)
+magic_match_record(const u_char *data, size_t len,
+    const magic_section_record_t *rec, const magic_section_record_t *end,
+    int *cost)
 {
-	int  cc, c, n, i, j, rl, mask;
+	int	     n, ncmp;
+	u_char	     mask;
+	int64_t	     start, last;
+	const u_char *val;
 
-	for (; rec != NULL; rec = rec->next) {
-		if (fseek(fp, rec->offset, SEEK_SET) == -1)
-			return (false);
-		if (buflen < rec->vlen)
-			if (extend_buffer(rec->vlen) == NULL)
-				return (false);
-		rl = rec->rangelen;
-		for (cc = n = 0; rl > 0 && n < rec->vlen;) {
-			buf[cc++] = (u_char)(c = fgetc(fp));
-			mask = rec->mask != NULL ? rec->mask[n] : 0xff;
-			if ((u_char)(c & mask) != (rec->val[n] & mask)) {
-				for (i = 1, j = 0; j + i < cc;) {
-					mask = rec->mask != NULL ? \
-					    rec->mask[j] : 0xff;
-					if ((buf[i + j] & mask) !=
-					    (rec->val[j] & mask))
-						i++, j = 0;
-					else
-						j++;
-				}	
-				rl -= i;
-				for (j = 0; i < cc; i++, j++)
-					buf[j] = buf[i];
-				n = cc = j;
-			} else
-				n++;
+	for (ncmp = 0; rec < end; rec++) {
+		val  = REC_VAL(rec);
+		last = (int64_t)rec->offset + rec->rangelen - 1;
+		if (last + rec->vlen > (int64_t)len)
+			last = (int64_t)len - rec->vlen;
+		for (start = rec->offset, n = 0; start <= last; start++) {
+			for (n = 0; n < rec->vlen; n++) {
+				mask = REC_MASK(rec, n);
+				ncmp++;
+				if ((data[start + n] & mask) != (val[n] & mask))
+					break;
+			}
+			if (n == rec->vlen)
+				break;
 		}
-		if (n != rec->vlen) {
+		if (start > last) {
 			/* Not found. */
-			if (rec->next == NULL ||
-			    rec->next->indent > rec->indent)
-				return (false);
-		} else if (rec->next == NULL ||
-		    rec->next->indent <= rec->indent)
+			if (rec + 1 == end || rec[1].indent > rec->indent)
+				break;
+		} else if (rec + 1 == end || rec[1].indent <= rec->indent) {
+			*cost = ncmp;
 			return (true);
+		}
 	}
+	*cost = ncmp;
 	return (false);
 }
 
-static magic_section_record_t *
-magic_dup_record(magic_section_record_t *rec)
+/*
+ * Like magic_match_record(), but for the beginning of a file which is
+ * still being received. Return MAGIC_UNDECIDED if the result depends
+ * on bytes beyond the first len bytes.
+ */
+static int
+magic_match_record_partial(const u_char *data, size_t len,
+    const magic_section_record_t *rec, const magic_section_record_t *end)
 {
-	magic_section_record_t *p;
-	
-	if ((p = malloc(sizeof(magic_section_record_t))) == NULL)
-		return (NULL);
-	(void)memcpy(p, rec, sizeof(magic_section_record_t));
-	if ((p->val = malloc(rec->vlen)) == NULL) {
-		free(p); return (NULL);
+	int	     n, start;
+	bool	     found, undecided;
+	u_char	     mask;
+	const u_char *val;
+
+	for (; rec < end; rec++) {
+		val   = REC_VAL(rec);
+		found = undecided = false;
+		for (start = rec->offset; !found &&
+		    start < rec->offset + rec->rangelen; start++) {
+			for (n = 0; n < rec->vlen && start + n < len; n++) {
+				mask = REC_MASK(rec, n);
+				if ((data[start + n] & mask) != (val[n] & mask))
+					break;
+			}
+			if (n == rec->vlen)
+				found = true;
+			else if (start + n >= len)
+				/* Ran out of data before a mismatch. */
+				undecided = true;
+		}
+		if (!found && undecided)
+			return (MAGIC_UNDECIDED);
+		if (!found) {
+			if (rec + 1 == end || rec[1].indent > rec->indent)
+				break;
+		} else if (rec + 1 == end || rec[1].indent <= rec->indent)
+			return (MAGIC_MATCH);
 	}
-	(void)memcpy(p->val, rec->val, rec->vlen);
-	p->next = NULL;
+	return (MAGIC_NOMATCH);
+}
 
-	return (p);
+/*
+ * Append n bytes to the blob, and return their index, or -1.
+ */
+static int64_t
+magic_add_data(const void *data, size_t n)
+{
+	u_char	 *p;
+	uint32_t size;
+
+	if (bloblen + n > blobsize) {
+		for (size = blobsize > 0 ? blobsize : 4096; size < bloblen + n;)
+			size *= 2;
+		if ((p = realloc(blob, size)) == NULL)
+			return (-1);
+		blob = p; blobsize = size;
+	}
+	(void)memcpy(blob + bloblen, data, n);
+	bloblen += n;
+
+	return (bloblen - n);
 }
 
-static magic_section_t *
-magic_new_section(void)
+/*
+ * Append the record, and its value and mask to the records array and
+ * the blob.
+ */
+static int
+magic_add_record(const magic_section_record_t *rec, const u_char *val,
+    const u_char *mask)
 {
-	magic_section_t *sec;
+	int64_t		       data;
+	uint32_t	       size;
+	magic_section_record_t *p;
 
-	if ((sec = malloc(sizeof(magic_section_t))) == NULL)
-		return (NULL);
-	sec->hdr  = NULL;
-	sec->rec  = NULL;
-	sec->next = NULL;
+	if (nrecords == recsize) {
+		size = recsize > 0 ? recsize * 2 : 512;
+		if ((p = realloc(records, size * sizeof(*p))) == NULL)
+			return (-1);
+		records = p; recsize = size;
+	}
+	if ((data = magic_add_data(val, rec->vlen)) == -1 ||
+	    (mask != NULL && magic_add_data(mask, rec->vlen) == -1))
+		return (-1);
+	records[nrecords] = *rec;
+	records[nrecords].data = (uint32_t)data;
+	records[nrecords++].hasmask = mask != NULL;
 
-	return (sec);
+	return (0);
 }
 
 static void
-magic_free_sections(magic_section_t *sec)
+magic_free_data(void)
 {
-	magic_section_t	       *next_sec;
-	magic_section_record_t *srec, *next_srec;
+	free(records); free(blob); free(mimetypes);
+	records = NULL; blob = NULL; mimetypes = NULL;
+	nrecords = recsize = bloblen = blobsize = ntypes = typesize = 0;
+}
 
-	for (; sec != NULL; sec = next_sec) {
-		next_sec = sec->next;
-		if (sec->hdr != NULL) {
-			if (sec->hdr->mime_type != NULL)
-				free(sec->hdr->mime_type);
-			free(sec->hdr);
-		}
-		for (srec = sec->rec; srec != NULL; srec = next_srec) {
-			next_srec = srec->next;
-			if (srec->val != NULL)
-				free(srec->val);
-			free(srec);
-		}
+/*
+ * Append a section of the given layer to the sections array, and return
+ * it, or NULL.
+ */
+static magic_section_t *
+magic_new_section(int layer)
+{
+	int		*l;
+	uint32_t	size;
+	magic_section_t *p;
+
+	if (nsections == secsize) {
+		size = secsize > 0 ? secsize * 2 : 256;
+		if ((p = realloc(sections, size * sizeof(*p))) == NULL)
+			return (NULL);
+		sections = p;
+		if ((l = realloc(layers, size * sizeof(*l))) == NULL)
+			return (NULL);
+		layers = l; secsize = size;
 	}
+	layers[nsections] = layer;
+	p = &sections[nsections++];
+	p->mime = p->rec = 0;
+	p->nrec = p->prio = 0;
+
+	return (p);
+}
+
+static void
+magic_free_sections(void)
+{
+	free(sections); free(layers); free(counters); free(order);
+	sections = NULL; layers = NULL; counters = NULL; order = NULL;
+	nsections = secsize = 0;
 }
 
 static magic_record_t *
 magic_read_record(FILE *fp)
 {
-	int c, n;
+	int c, n, op;
+	long len;
+	int64_t off;
 	static char	      num[12];
 	static magic_record_t  rec;
 	magic_section_header_t *shdr;
@@ -214,7 +358,7 @@ magic_read_record(FILE *fp)
 		rec.type = MAGIC_TYPE_HEADER;
 		shdr = &rec.rec.shdr;
 
-		for (n = 0; n < sizeof(num) && (c = fgetc(fp)) != EOF &&
+		for (n = 0; n < sizeof(num) - 1 && (c = fgetc(fp)) != EOF &&
 		    c != ':'; n++)
 			num[n] = (char)c;
 		num[n] = '\0';
@@ -223,8 +367,9 @@ magic_read_record(FILE *fp)
 			return (NULL);
 		shdr->prio = (u_short)strtol(num, NULL, 10);
 		for (n = 0; (c = fgetc(fp)) != EOF && c != ']'; n++) {
-			if (n >= buflen)
-				if (extend_buffer(n) == NULL)
+			/* Leave room for the terminating '\0'. */
+			if (n + 1 >= buflen)
+				if (extend_buffer(n + 1) == NULL)
 					return (NULL);
 			buf[n] = (char)c;
 		}
@@ -240,7 +385,7 @@ magic_read_record(FILE *fp)
 		srec = &rec.rec.srec;
 
 		/* Set default values. */
-		srec->mask     = NULL;
+		rec.mask       = NULL;
 		srec->wsize    = 1;
 		srec->indent   = 0;
 		srec->rangelen = 1;
@@ -249,7 +394,7 @@ magic_read_record(FILE *fp)
 			/* Indent. */
 			n = 0;
 			num[n++] = (char)c;
-			for (; n < sizeof(num) && (c = fgetc(fp)) != EOF &&
+			for (; n < sizeof(num) - 1 && (c = fgetc(fp)) != EOF &&
 			    c != '>'; n++)
 				num[n] = (char)c;
 			num[n] = '\0';
@@ -259,15 +404,22 @@ magic_read_record(FILE *fp)
 			srec->indent = (char)strtol(num, NULL, 10);
 		} else if (c != '>')
 			return (NULL);
-		/* Get the start-offset. */
-		for (n = 0;
-		    n < sizeof(num) && (c = fgetc(fp)) != EOF && c != '='; n++)
-			num[n] = (char)c;
-		num[n] = '\0';
+		/*
+		 * Get the start-offset. Read a number which doesn't fit into
+		 * num up to the '=', so that the value which follows doesn't
+		 * get parsed as a record, and reject the record at the end of
+		 * the line.
+		 */
+		for (n = 0; (c = fgetc(fp)) != EOF && c != '=' && c != '\n';
+		    n++) {
+			if (n < sizeof(num) - 1)
+				num[n] = (char)c;
+		}
 		if (c != '=')
 			return (NULL);
-		srec->offset = (int)strtol(num, NULL, 10);
-		
+		num[n < sizeof(num) - 1 ? n : sizeof(num) - 1] = '\0';
+		off = n < sizeof(num) - 1 ? strtoll(num, NULL, 10) : -1;
+
 		/* Get the value length and the value. */
 		for (n = 0; n < 2 && (c = fgetc(fp)) != EOF; n++)
 			num[n] = (char)c;
@@ -279,45 +431,55 @@ magic_read_record(FILE *fp)
 			return (NULL);
 		for (n = 0; n < srec->vlen && (c = fgetc(fp)) != EOF; n++)
 			buf[n] = (char)c;
-		srec->val = buf;
+		rec.val = buf;
 		if (c == EOF)
 			return (NULL);
 		
 		while ((c = fgetc(fp)) != EOF)
 			switch (c) {
 			case '\n':
+				/*
+				 * Reject records which would make us read
+				 * more than MAGIC_MAX_EXTENT bytes.
+				 */
+				if (off < 0 || off + srec->rangelen - 1 +
+				    srec->vlen > MAGIC_MAX_EXTENT)
+					return (NULL);
+				srec->offset = (int32_t)off;
 				return (&rec);
 			case '&':
-				for (n = 0; n < 2 &&
-				    (c = fgetc(fp)) != EOF; n++)
-					num[n] = (char)c;
-				if (n != 2)
-					return (NULL);
+				/* The mask has the length of the value. */
 				if (buflen < srec->vlen * 2 &&
 				    extend_buffer(srec->vlen * 2) == NULL)
 					return (NULL);
-				srec->mask = buf + srec->vlen;
+				/* buf might have been moved by realloc(). */
+				rec.val	 = buf;
+				rec.mask = buf + srec->vlen;
 				for (n = 0; n < srec->vlen &&
 				    (c = fgetc(fp)) != EOF; n++)
-					srec->mask[n] = (u_char)c;
+					rec.mask[n] = (u_char)c;
 				if (n != srec->vlen)
 					return (NULL);
 				break;
 			case '~':
 			case '+':
-				/* FALLTHROUGH */
-				for (n = 0; n < sizeof(num) &&
+				op = c;
+				for (n = 0; n < sizeof(num) - 1 &&
 				    (c = fgetc(fp)) != EOF && isdigit(c); n++)
 					num[n] = (char)c;
 				num[n] = '\0';
-				if (n == 0 || n > sizeof(num))
+				len = strtol(num, NULL, 10);
+				if (n == 0 || n == sizeof(num) - 1 ||
+				    (op == '+' && len > UINT16_MAX)) {
+					/* Syntax error. Seek to next line. */
+					while (c != '\n' && c != EOF)
+						c = fgetc(fp);
 					return (NULL);
-				if (c == '~')
-					srec->wsize =
-					    (char)strtol(num, NULL, 10);
+				}
+				if (op == '~')
+					srec->wsize = (char)len;
 				else
-					srec->rangelen =
-					    (char)strtol(num, NULL, 10);
+					srec->rangelen = (uint16_t)len;
 				(void)ungetc(c, fp);
 				break;
 			default:
@@ -330,98 +492,885 @@ magic_read_record(FILE *fp)
 	return (NULL);
 }
 
-static magic_section_t *
-magic_read_file(const char *path)
+/*
+ * Append the sections of the given magic file to the sections array.
+ * "layer" is the file's rank in the list of data directories, 0 being
+ * the most important one.
+ */
+static int
+magic_read_file(const char *path, int layer)
 {
-	FILE *fp;
-	magic_record_t	       *rec;
-	magic_section_t	       *sec, *magic;
-	magic_section_record_t *srec;
+	FILE		*fp;
+	int64_t		mime;
+	magic_record_t	*rec;
+	magic_section_t *sec;
 
 	if ((fp = fopen(path, "r")) == NULL)
-		return (NULL);
+		return (-1);
 	if (extend_buffer(sizeof(MAGICSTR)) == NULL) {
 		free_buffer();
-		return (NULL);
+		return (-1);
 	}
 	if (fgets((char *)buf, sizeof(MAGICSTR), fp) == NULL) {
 		(void)fclose(fp); free_buffer();
-		return (NULL);
+		return (-1);
 	}
 	if (memcmp(buf, MAGICSTR, sizeof(MAGICSTR) - 1) != 0) {
 		warnx("%s: %s doesn't seem to be a valid magic file", LIBNAME,
 		    path);
 		(void)fclose(fp); free_buffer();
-		return (NULL);
+		return (-1);
 	}
-	sec = magic = NULL;
-	while (!feof(fp)) {
+	for (sec = NULL; !feof(fp);) {
 		rec = magic_read_record(fp);
 		if (rec == NULL)
 			continue;
 		if (rec->type == MAGIC_TYPE_HEADER) {
-			if (magic != NULL) {
-				if ((sec->next = magic_new_section()) == NULL)
-					return (NULL);
-				sec = sec->next;
-			} else {
-				if ((magic = magic_new_section()) == NULL)
-					return (NULL);
-				sec = magic;
+			if ((sec = magic_new_section(layer)) == NULL) {
+				(void)fclose(fp); return (-1);
 			}
-			sec->hdr = malloc(sizeof(magic_section_record_t));
-			if (sec->hdr == NULL) {
-				(void)fclose(fp); return (NULL);
+			sec->prio  = rec->rec.shdr.prio;
+			sec->rec   = nrecords;
+			if ((mime = magic_add_data(rec->rec.shdr.mime_type,
+			    strlen(rec->rec.shdr.mime_type) + 1)) == -1) {
+				(void)fclose(fp); return (-1);
 			}
-			sec->hdr->prio = rec->rec.shdr.prio;
-			sec->hdr->mime_type = strdup(rec->rec.shdr.mime_type);
-			if (sec->hdr->mime_type == NULL) {
-				(void)fclose(fp); free(sec->hdr);
-				return (NULL);
-			}
-		} else {
-			if (sec->rec == NULL) {
-				/* First section record in section. */
-				sec->rec = magic_dup_record(&rec->rec.srec);
-				srec = sec->rec;
-			} else {
-				/* Add a new section record to section. */
-				srec->next = magic_dup_record(&rec->rec.srec);
-				srec = srec->next;
+			sec->mime = (uint32_t)mime;
+		} else if (sec != NULL) {
+			if (magic_add_record(&rec->rec.srec, rec->val,
+			    rec->mask) == -1) {
+				(void)fclose(fp); return (-1);
 			}
+			sec->nrec++;
 		}
 	}
 	(void)fclose(fp);
-	return (magic);
+
+	return (0);
+}
+
+/*
+ * Compute the number of bytes the sections look at.
+ */
+static void
+magic_calc_extent(void)
+{
+	int64_t		       extent;
+	magic_section_t	       *sec;
+	magic_section_record_t *srec;
+
+	maxextent = 0;
+	for (sec = sections; sec < sections + nsections; sec++)
+		for (srec = SEC_FIRST(sec); srec < SEC_END(sec); srec++) {
+			extent = (int64_t)srec->offset + srec->rangelen - 1 +
+			    srec->vlen;
+			if (srec->rangelen > 0 && extent > maxextent)
+				maxextent = (int)extent;
+		}
+}
+
+/*
+ * Copy the n sections whose indices are in v, in this order, and their
+ * records and values to new arrays of the exact size. This drops the
+ * sections removed by magic_merge(), and the unused space of the
+ * growing arrays.
+ */
+static int
+magic_pack(const uint32_t *v, uint32_t n)
+{
+	size_t			len;
+	u_char			*newblob;
+	uint32_t		i, nrec, size;
+	magic_section_t		*sec, *newsecs;
+	magic_section_record_t	*rec, *newrecs;
+
+	for (nrec = size = i = 0; i < n; i++) {
+		sec = &sections[v[i]];
+		nrec += sec->nrec;
+		size += strlen(SEC_MIME(sec)) + 1;
+		for (rec = SEC_FIRST(sec); rec < SEC_END(sec); rec++)
+			size += rec->hasmask ? 2 * rec->vlen : rec->vlen;
+	}
+	newrecs = malloc((nrec > 0 ? nrec : 1) * sizeof(*newrecs));
+	newsecs = malloc((n > 0 ? n : 1) * sizeof(*newsecs));
+	newblob = malloc(size > 0 ? size : 1);
+	counters = calloc(n > 0 ? n : 1, sizeof(*counters));
+	order = malloc((n > 0 ? n : 1) * sizeof(*order));
+	if (newrecs == NULL || newsecs == NULL || newblob == NULL ||
+	    counters == NULL || order == NULL) {
+		free(newrecs); free(newsecs); free(newblob);
+		return (-1);
+	}
+	for (nrec = size = i = 0; i < n; i++) {
+		sec = &sections[v[i]];
+		newsecs[i] = *sec;
+		len = strlen(SEC_MIME(sec)) + 1;
+		(void)memcpy(newblob + size, SEC_MIME(sec), len);
+		newsecs[i].mime = size;
+		newsecs[i].rec	= nrec;
+		size += len;
+		for (rec = SEC_FIRST(sec); rec < SEC_END(sec); rec++, nrec++) {
+			len = rec->hasmask ? 2 * rec->vlen : rec->vlen;
+			(void)memcpy(newblob + size, REC_VAL(rec), len);
+			newrecs[nrec] = *rec;
+			newrecs[nrec].data = size;
+			size += len;
+		}
+		order[i] = i;
+	}
+	free(records); free(blob); free(sections); free(layers);
+	records = newrecs; nrecords = recsize = nrec;
+	blob = newblob; bloblen = blobsize = size;
+	sections = newsecs; nsections = secsize = n;
+	layers = NULL;
+
+	return (0);
+}
+
+static int
+magic_cmp_mime(const void *a, const void *b)
+{
+	return (strcmp((const char *)blob + *(const uint32_t *)a,
+	    (const char *)blob + *(const uint32_t *)b));
+}
+
+static int
+magic_cmp_key(const void *key, const void *b)
+{
+	return (strcmp(key, (const char *)blob + *(const uint32_t *)b));
+}
+
+/*
+ * Make a sorted list of the MIME types which have sections, so that
+ * magic_has_rules() doesn't need to walk the sections.
+ */
+static int
+magic_index_types(void)
+{
+	uint32_t i, *p;
+
+	typesize  = nsections > 0 ? nsections : 1;
+	mimetypes = malloc(typesize * sizeof(uint32_t));
+	if (mimetypes == NULL)
+		return (-1);
+	for (i = 0; i < nsections; i++)
+		mimetypes[i] = sections[i].mime;
+	qsort(mimetypes, nsections, sizeof(uint32_t), magic_cmp_mime);
+	for (ntypes = 0, i = 0; i < nsections; i++) {
+		if (ntypes == 0 ||
+		    magic_cmp_mime(&mimetypes[ntypes - 1], &mimetypes[i]) != 0)
+			mimetypes[ntypes++] = mimetypes[i];
+	}
+	/* Give back the room of the duplicates. */
+	if (ntypes > 0 && ntypes < typesize &&
+	    (p = realloc(mimetypes, ntypes * sizeof(uint32_t))) != NULL) {
+		mimetypes = p; typesize = ntypes;
+	}
+	return (0);
+}
+
+/*
+ * Return true if the section is a __NOMAGIC__ entry.
+ */
+static bool
+magic_is_nomagic(const magic_section_t *sec)
+{
+	const magic_section_record_t *srec;
+
+	for (srec = SEC_FIRST(sec); srec < SEC_END(sec); srec++)
+		if (srec->vlen == sizeof(NOMAGIC) - 1 &&
+		    memcmp(REC_VAL(srec), NOMAGIC, srec->vlen) == 0)
+			return (true);
+	return (false);
+}
+
+/*
+ * Return true if the two sections have the same priority and records.
+ */
+static bool
+magic_sections_equal(const magic_section_t *a, const magic_section_t *b)
+{
+	const magic_section_record_t *ra, *rb;
+
+	if (a->prio != b->prio || a->nrec != b->nrec)
+		return (false);
+	for (ra = SEC_FIRST(a), rb = SEC_FIRST(b); ra < SEC_END(a);
+	    ra++, rb++) {
+		/* The mask follows the value. */
+		if (ra->rangelen != rb->rangelen || ra->offset != rb->offset ||
+		    ra->wsize != rb->wsize || ra->indent != rb->indent ||
+		    ra->vlen != rb->vlen || ra->hasmask != rb->hasmask ||
+		    memcmp(REC_VAL(ra), REC_VAL(rb),
+		    ra->hasmask ? 2 * ra->vlen : ra->vlen) != 0)
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * The sections are compared by their indices in v. The files are read
+ * from the most to the least important one, so the order of the indices
+ * is the order of the layers, and of the positions in the files.
+ */
+static int
+magic_cmp_type(const void *a, const void *b)
+{
+	int	 ret;
+	uint32_t ia = *(const uint32_t *)a;
+	uint32_t ib = *(const uint32_t *)b;
+
+	if ((ret = strcmp(SEC_MIME(&sections[ia]),
+	    SEC_MIME(&sections[ib]))) != 0)
+		return (ret);
+	return (ia < ib ? -1 : ia > ib);
+}
+
+static int
+magic_cmp_prio(const void *a, const void *b)
+{
+	uint32_t ia = *(const uint32_t *)a;
+	uint32_t ib = *(const uint32_t *)b;
+
+	if (sections[ia].prio != sections[ib].prio)
+		return (sections[ib].prio - sections[ia].prio);
+	return (ia < ib ? -1 : ia > ib);
+}
+
+/*
+ * Merge the sections read from several magic files. v holds the
+ * indices of all *n sections. A section defined by more than one file
+ * is kept once. A __NOMAGIC__ entry removes the sections of its type
+ * defined by less important files. On return, v holds the indices of
+ * the *n remaining sections, ordered by priority, and sections of
+ * equal priority by layer and position in the file.
+ */
+static void
+magic_merge(uint32_t *v, uint32_t *n)
+{
+	int	 cut;
+	bool	 drop;
+	uint32_t i, j, k, m;
+
+	qsort(v, *n, sizeof(uint32_t), magic_cmp_type);
+	for (i = 0; i < *n; i = j) {
+		/* Find the most important __NOMAGIC__ of this type. */
+		for (cut = INT_MAX, j = i; j < *n && strcmp(
+		    SEC_MIME(&sections[v[j]]), SEC_MIME(&sections[v[i]])) == 0;
+		    j++) {
+			if (layers[v[j]] < cut &&
+			    magic_is_nomagic(&sections[v[j]]))
+				cut = layers[v[j]];
+		}
+		for (k = i; k < j; k++) {
+			drop = layers[v[k]] > cut ||
+			    magic_is_nomagic(&sections[v[k]]);
+			/* Look for a copy in a more important file. */
+			for (m = i; m < k && !drop; m++) {
+				drop = v[m] != UINT32_MAX &&
+				    layers[v[m]] < layers[v[k]] &&
+				    magic_sections_equal(&sections[v[m]],
+				    &sections[v[k]]);
+			}
+			if (drop)
+				v[k] = UINT32_MAX;
+		}
+	}
+	for (i = j = 0; i < *n; i++)
+		if (v[i] != UINT32_MAX)
+			v[j++] = v[i];
+	qsort(v, j, sizeof(uint32_t), magic_cmp_prio);
+	*n = j;
+}
+
+/*
+ * Return true if the two records can't both match the same file. We
+ * only look at records with a fixed offset. They are disjoint if there
+ * is a byte both records test, and whose bits covered by both masks
+ * differ.
+ */
+static bool
+magic_records_disjoint(const magic_section_record_t *a,
+    const magic_section_record_t *b)
+{
+	int    p, start, end;
+	u_char ma, mb;
+
+	if (a->rangelen != 1 || b->rangelen != 1)
+		return (false);
+	start = a->offset > b->offset ? a->offset : b->offset;
+	end   = a->offset + a->vlen < b->offset + b->vlen ?
+	    a->offset + a->vlen : b->offset + b->vlen;
+	for (p = start; p < end; p++) {
+		ma = REC_MASK(a, p - a->offset);
+		mb = REC_MASK(b, p - b->offset);
+		if (((REC_VAL(a)[p - a->offset] ^ REC_VAL(b)[p - b->offset]) &
+		    ma & mb) != 0)
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * A section can only match if one of its top level records matches,
+ * because magic_match_record() only descends into the children of a
+ * matching record. Two sections are disjoint if all pairs of their top
+ * level records are.
+ */
+static bool
+magic_sections_disjoint(const magic_section_t *a, const magic_section_t *b)
+{
+	const magic_section_record_t *ra, *rb;
+
+	if ((a->nrec > 0 && SEC_FIRST(a)->indent != 0) ||
+	    (b->nrec > 0 && SEC_FIRST(b)->indent != 0))
+		return (false);
+	for (ra = SEC_FIRST(a); ra < SEC_END(a); ra++) {
+		if (ra->indent != 0)
+			continue;
+		for (rb = SEC_FIRST(b); rb < SEC_END(b); rb++) {
+			if (rb->indent != 0)
+				continue;
+			if (!magic_records_disjoint(ra, rb))
+				return (false);
+		}
+	}
+	return (true);
+}
+
+#define DISJOINT(g, i, j) \
+	((g)->disjoint[((i) * (g)->nsec + (j)) / 8] & \
+	    (1 << (((i) * (g)->nsec + (j)) % 8)))
+
+static void
+magic_free_groups(void)
+{
+	int i;
+
+	for (i = 0; i < ngroups; i++)
+		free(groups[i].disjoint);
+	free(groups);
+	groups = NULL; ngroups = 0;
+}
+
+/*
+ * Split the sections into groups of equal priority, and compute the
+ * disjointness matrix for each group. The sections of a group are
+ * adjacent in the sections array.
+ */
+static int
+magic_gen_groups(void)
+{
+	int		i, j, n;
+	uint32_t	s;
+	magic_group_t	*g;
+	magic_section_t *sp;
+
+	for (n = 0, s = 0; s < nsections; s++) {
+		if (s + 1 == nsections || sections[s + 1].prio !=
+		    sections[s].prio)
+			n++;
+	}
+	if ((groups = calloc(n > 0 ? n : 1, sizeof(magic_group_t))) == NULL)
+		return (-1);
+	ngroups = n;
+	for (g = groups, s = 0; s < nsections; g++, s += n) {
+		for (n = 0; s + n < nsections &&
+		    sections[s + n].prio == sections[s].prio; n++)
+			;
+		g->nsec	 = n;
+		g->first = s;
+		if ((g->disjoint = calloc((n * n + 7) / 8, 1)) == NULL) {
+			magic_free_groups();
+			return (-1);
+		}
+		for (sp = sections + s, i = 0; i < n; i++) {
+			for (j = i + 1; j < n; j++) {
+				if (!magic_sections_disjoint(&sp[i], &sp[j]))
+					continue;
+				g->disjoint[(i * n + j) / 8] |=
+				    1 << ((i * n + j) % 8);
+				g->disjoint[(j * n + i) / 8] |=
+				    1 << ((j * n + i) % 8);
+			}
+		}
+	}
+	return (0);
+}
+
+/*
+ * Expected benefit of testing a section early: The probability of a
+ * match, hits / tests, divided by the average cost of a test,
+ * (cost + tests) / tests. A test costs one for the call, and one for
+ * each byte compared, so the cost is never zero.
+ */
+static double
+magic_section_score(const magic_counter_t *cp)
+{
+	if (cp->hits == 0)
+		return (0);
+	return ((double)cp->hits / (cp->cost + cp->tests));
+}
+
+/*
+ * Reorder the sections of each group by their score. A section can
+ * only be placed after all sections which precede it in the file, and
+ * which are not disjoint from it, have been placed. If "decay" is
+ * true, the counters are halved afterwards, so that older observations
+ * fade out. Must be called with order_lock held for writing.
+ */
+static int
+magic_reorder(bool decay)
+{
+	int		i, j, k, best, *blocked;
+	double		score, best_score;
+	magic_group_t	*g;
+	magic_counter_t *cp;
+
+	for (i = 0, k = 1; i < ngroups; i++)
+		if (groups[i].nsec > k)
+			k = groups[i].nsec;
+	if ((blocked = malloc(k * sizeof(int))) == NULL)
+		return (-1);
+	for (g = groups; g < groups + ngroups; g++) {
+		for (i = 0; i < g->nsec; i++) {
+			for (blocked[i] = j = 0; j < i; j++)
+				if (!DISJOINT(g, i, j))
+					blocked[i]++;
+		}
+		for (k = 0; k < g->nsec; k++) {
+			best = -1; best_score = 0;
+			for (i = 0; i < g->nsec; i++) {
+				if (blocked[i] != 0)
+					continue;
+				score = magic_section_score(
+				    &counters[g->first + i]);
+				if (best == -1 || score > best_score) {
+					best = i; best_score = score;
+				}
+			}
+			order[g->first + k] = g->first + best;
+			/* Mark as placed. */
+			blocked[best] = -1;
+			for (i = best + 1; i < g->nsec; i++)
+				if (blocked[i] > 0 && !DISJOINT(g, best, i))
+					blocked[i]--;
+		}
+		for (k = 0; decay && k < g->nsec; k++) {
+			cp = &counters[g->first + k];
+			cp->hits /= 2; cp->tests /= 2; cp->cost /= 2;
+		}
+	}
+	free(blocked);
+
+	return (0);
+}
+
+/*
+ * Open the given file for the content stages. Return the file
+ * descriptor, or -1 if an error occurred.
+ */
+int
+magic_open(const char *file)
+{
+	int fd;
+
+	if ((fd = io_open(file)) == -1) {
+		warn("%s: open(%s)", LIBNAME, file);
+		return (-1);
+	}
+	STATS_INC(magic_opens);
+
+	return (fd);
+}
+
+/*
+ * Read the first bytes of the given file from fd, as many as the magic
+ * rules need, but not more than limit bytes if limit is not 0, into a
+ * newly allocated buffer. Return the number of bytes read, or -1 if an
+ * error occurred.
+ */
+ssize_t
+magic_read_prefix(const char *file, int fd, u_char **prefix, size_t limit)
+{
+	size_t	size, bufsize;
+	ssize_t len;
+
+	size = magic_prefix_size();
+	if (limit > 0 && limit < size)
+		size = bufsize = limit;
+	else
+		bufsize = io_read_size(size);
+	if ((*prefix = malloc(bufsize)) == NULL)
+		return (-1);
+	/* Read the prefix in one request, rounded up to the alignment. */
+	if ((len = io_pread(fd, *prefix, bufsize, 0)) == -1) {
+		warn("%s: read(%s)", LIBNAME, file);
+		free(*prefix); *prefix = NULL;
+		return (-1);
+	}
+	STATS_ADD(magic_bytes, len);
+
+	return (len < size ? len : (ssize_t)size);
+}
+
+/*
+ * Return the MIME type of the first section matching the given file
+ * prefix, or NULL. The order lock is taken even if the adaptive mode is
+ * off, because magic_load_order() can reorder the sections anyway.
+ */
+const char *
+magic_match_buffer(const u_char *prefix, size_t len)
+{
+	int		cost;
+	bool		match;
+	u_int		interval;
+	uint32_t	i;
+	const char	*mime;
+	magic_counter_t *cp;
+	magic_section_t *mp;
+	STATS_TIMER(t);
+
+	STATS_START(t);
+	(void)pthread_rwlock_rdlock(&order_lock);
+	interval = adapt_interval;
+	for (mime = NULL, i = 0; i < nsections && mime == NULL; i++) {
+		mp = &sections[order[i]];
+		STATS_INC(magic_sections);
+		match = magic_match_record(prefix, len, SEC_FIRST(mp),
+		    SEC_END(mp), &cost);
+		if (interval > 0) {
+			cp = &counters[order[i]];
+			__atomic_add_fetch(&cp->tests, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&cp->cost, cost, __ATOMIC_RELAXED);
+			if (match) {
+				__atomic_add_fetch(&cp->hits, 1,
+				    __ATOMIC_RELAXED);
+			}
+		}
+		if (match)
+			mime = SEC_MIME(mp);
+	}
+	(void)pthread_rwlock_unlock(&order_lock);
+	if (interval > 0 && __atomic_add_fetch(&adapt_count, 1,
+	    __ATOMIC_RELAXED) % interval == 0 &&
+	    pthread_rwlock_trywrlock(&order_lock) == 0) {
+		(void)magic_reorder(true);
+		(void)pthread_rwlock_unlock(&order_lock);
+	}
+	STATS_STOP(t, DSBMIME_STAGE_MAGIC);
+	if (mime != NULL)
+		STATS_INC(hits[DSBMIME_STAGE_MAGIC]);
+	return (mime);
+}
+
+/*
+ * Store the MIME types of up to n sections matching the given file
+ * prefix in cand, in the order the sections are tested, and return
+ * their number.
+ */
+int
+magic_match_all(const u_char *prefix, size_t len, dsbmime_candidate_t *cand,
+	int n)
+{
+	int		i, cost;
+	uint32_t	s;
+	magic_section_t *mp;
+
+	(void)pthread_rwlock_rdlock(&order_lock);
+	for (i = 0, s = 0; s < nsections && i < n; s++) {
+		mp = &sections[order[s]];
+		STATS_INC(magic_sections);
+		if (!magic_match_record(prefix, len, SEC_FIRST(mp), SEC_END(mp),
+		    &cost))
+			continue;
+		cand[i].type   = SEC_MIME(mp);
+		cand[i].source = DSBMIME_SOURCE_MAGIC;
+		cand[i].score  = mp->prio;
+		i++;
+	}
+	(void)pthread_rwlock_unlock(&order_lock);
+
+	return (i);
+}
+
+/*
+ * Try to determine the result of magic_match_buffer() from the first
+ * len bytes of a file which is still being received. Return 1 and set
+ * *mime to the MIME type of the first matching section, or to NULL if
+ * no section can match. Return 0 if more data is needed.
+ */
+int
+magic_match_partial(const u_char *prefix, size_t len, const char **mime)
+{
+	int		ret;
+	uint32_t	i;
+	magic_section_t *mp;
+
+	(void)pthread_rwlock_rdlock(&order_lock);
+	for (ret = 1, i = 0; i < nsections; i++) {
+		mp = &sections[order[i]];
+		switch (magic_match_record_partial(prefix, len, SEC_FIRST(mp),
+		    SEC_END(mp))) {
+		case MAGIC_UNDECIDED:
+			ret = 0;
+			break;
+		case MAGIC_MATCH:
+			STATS_INC(hits[DSBMIME_STAGE_MAGIC]);
+			*mime = SEC_MIME(mp);
+			break;
+		default:
+			continue;
+		}
+		break;
+	}
+	if (i == nsections)
+		*mime = NULL;
+	(void)pthread_rwlock_unlock(&order_lock);
+
+	return (ret);
+}
+
+/*
+ * Check whether there is a section for the given MIME type. The list
+ * of types doesn't change before magic_cleanup(), so there is no need
+ * to take the order lock.
+ */
+bool
+magic_has_rules(const char *mime)
+{
+	if (ntypes == 0)
+		return (false);
+	return (bsearch(mime, mimetypes, ntypes, sizeof(uint32_t),
+	    magic_cmp_key) != NULL);
+}
+
+/*
+ * Return the number of bytes magic_read_prefix() reads at most.
+ */
+size_t
+magic_prefix_size(void)
+{
+	return (maxextent > MAGIC_MIN_PREFIX ? maxextent : MAGIC_MIN_PREFIX);
 }
 
 const char *
 magic_lookup_mime_type(const char *file)
+{
+	int	   fd;
+	u_char	   *prefix;
+	ssize_t	   len;
+	const char *mime;
+
+	if ((fd = magic_open(file)) == -1)
+		return (NULL);
+	len = magic_read_prefix(file, fd, &prefix, 0);
+	io_close(fd);
+	if (len == -1)
+		return (NULL);
+	mime = magic_match_buffer(prefix, len);
+	free(prefix);
+
+	return (mime);
+}
+
+int
+magic_set_adaptive(u_int interval)
+{
+	int ret = 0;
+
+	(void)pthread_rwlock_wrlock(&order_lock);
+	if (interval > 0 && groups == NULL && magic_gen_groups() == -1)
+		ret = -1;
+	else
+		adapt_interval = interval;
+	(void)pthread_rwlock_unlock(&order_lock);
+
+	return (ret);
+}
+
+/*
+ * Write the learned counters to the given file, one section per line in
+ * the current order: "<prio>\t<mime type>\t<hits>\t<tests>\t<cost>"
+ */
+int
+magic_save_order(const char *path)
 {
 	FILE		*fp;
+	uint32_t	i;
+	magic_counter_t *cp;
 	magic_section_t *mp;
 
-	if ((fp = fopen(file, "r")) == NULL) {
-		warn("%s: fopen(%s)", LIBNAME, file); return (NULL);
+	if ((fp = fopen(path, "w")) == NULL)
+		return (-1);
+	(void)pthread_rwlock_rdlock(&order_lock);
+	for (i = 0; i < nsections; i++) {
+		mp = &sections[order[i]];
+		cp = &counters[order[i]];
+		(void)fprintf(fp, "%u\t%s\t%u\t%u\t%llu\n", mp->prio,
+		    SEC_MIME(mp), cp->hits, cp->tests,
+		    (unsigned long long)cp->cost);
+	}
+	(void)pthread_rwlock_unlock(&order_lock);
+	if (fclose(fp) != 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Load counters saved by magic_save_order(), and reorder the sections
+ * accordingly. Lines referring to sections which don't exist in the
+ * current database are ignored.
+ */
+int
+magic_load_order(const char *path)
+{
+	int		i, ret;
+	char		*line, *mime;
+	bool		*loaded;
+	u_int		prio, hits, tests;
+	FILE		*fp;
+	uint32_t	s;
+	magic_group_t	*g;
+	magic_counter_t *cp;
+	unsigned long long cost;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+	line = malloc(_POSIX2_LINE_MAX); mime = malloc(_POSIX2_LINE_MAX);
+	if (line == NULL || mime == NULL) {
+		free(line); free(mime); (void)fclose(fp);
+		return (-1);
+	}
+	(void)pthread_rwlock_wrlock(&order_lock);
+	if (groups == NULL && magic_gen_groups() == -1) {
+		(void)pthread_rwlock_unlock(&order_lock);
+		(void)fclose(fp); free(line); free(mime);
+		return (-1);
+	}
+	if ((loaded = calloc(nsections + 1, sizeof(bool))) == NULL) {
+		(void)pthread_rwlock_unlock(&order_lock);
+		(void)fclose(fp); free(line); free(mime);
+		return (-1);
 	}
-	for (mp = magic_sections; mp != NULL; mp = mp->next)
-		if (magic_match_record(fp, mp->rec)) {
-			(void)fclose(fp);
-			return (mp->hdr->mime_type);
+	while (fgets(line, _POSIX2_LINE_MAX, fp) != NULL) {
+		if (sscanf(line, "%u\t%s\t%u\t%u\t%llu", &prio, mime, &hits,
+		    &tests, &cost) != 5)
+			continue;
+		for (g = groups; g < groups + ngroups; g++) {
+			if (sections[g->first].prio != prio)
+				continue;
+			/*
+			 * A MIME type can have several sections of equal
+			 * priority. Take the first one not loaded yet.
+			 */
+			for (i = 0; i < g->nsec; i++) {
+				s = g->first + i;
+				if (loaded[s] ||
+				    strcmp(SEC_MIME(&sections[s]), mime) != 0)
+					continue;
+				cp = &counters[s];
+				cp->hits = hits; cp->tests = tests;
+				cp->cost = cost;
+				loaded[s] = true;
+				break;
+			}
+			break;
 		}
-	(void)fclose(fp);
-	return (NULL);
+	}
+	ret = magic_reorder(false);
+	(void)pthread_rwlock_unlock(&order_lock);
+	(void)fclose(fp); free(line); free(mime); free(loaded);
+
+	return (ret);
 }
 
 int
-magic_init(const char *magicpath)
+magic_nsections(void)
 {
+	return ((int)nsections);
+}
+
+/*
+ * Write a file header to "out" which satisfies the first chain of
+ * records (the first top level record, its first child, and so on) of
+ * the n-th section. Bytes not covered by a record are set to 0. Return
+ * the length of the header, and set *type to the section's MIME type.
+ */
+ssize_t
+magic_gen_sample(int n, u_char *out, size_t size, const char **type)
+{
+	int			i, len;
+	u_char			mask;
+	magic_section_t		*mp;
+	magic_section_record_t	*rec;
+
+	(void)pthread_rwlock_rdlock(&order_lock);
+	if (n < 0 || (uint32_t)n >= nsections) {
+		(void)pthread_rwlock_unlock(&order_lock);
+		return (-1);
+	}
+	mp = &sections[order[n]];
+	*type = SEC_MIME(mp);
+	(void)memset(out, 0, size);
+	for (len = 0, rec = SEC_FIRST(mp); rec < SEC_END(mp); rec++) {
+		if (rec->offset + rec->vlen > size)
+			break;
+		for (i = 0; i < rec->vlen; i++) {
+			mask = REC_MASK(rec, i);
+			out[rec->offset + i] &= ~mask;
+			out[rec->offset + i] |= REC_VAL(rec)[i] & mask;
+		}
+		if (rec->offset + rec->vlen > len)
+			len = rec->offset + rec->vlen;
+		if (rec + 1 == SEC_END(mp) || rec[1].indent <= rec->indent)
+			break;
+	}
+	(void)pthread_rwlock_unlock(&order_lock);
+
+	return (len);
+}
+
+/*
+ * Load the given magic files, ordered from the most to the least
+ * important one, into a single array of sections.
+ */
+int
+magic_init(char *const *paths, int npaths)
+{
+	int		i;
+	bool		merge;
+	uint32_t	n, *v;
+
 	if (init != 0)
 		return (-1);
-	buflen = 0; buf = NULL;
-	if ((magic_sections = magic_read_file(magicpath)) == NULL)
+	buflen = 0; buf = NULL; maxextent = 0;
+	for (merge = npaths > 1, i = 0; i < npaths; i++) {
+		if (magic_read_file(paths[i], i) == -1) {
+			magic_free_sections(); free_buffer();
+			magic_free_data();
+			return (-1);
+		}
+	}
+	free_buffer();
+	for (n = 0; n < nsections && !merge; n++)
+		merge = magic_is_nomagic(&sections[n]);
+	if ((v = malloc((nsections > 0 ? nsections : 1) *
+	    sizeof(*v))) == NULL) {
+		magic_free_sections(); magic_free_data();
+		return (-1);
+	}
+	for (n = 0; n < nsections; n++)
+		v[n] = n;
+	if (merge)
+		magic_merge(v, &n);
+	if (magic_pack(v, n) == -1 || magic_index_types() == -1) {
+		free(v); magic_free_sections(); magic_free_data();
 		return (-1);
-	init = 1; 
+	}
+	free(v);
+	magic_calc_extent();
+	init = 1;
+
 	return (0);
 }
 
@@ -430,9 +1379,35 @@ magic_cleanup(void)
 {
 	if (init == 0)
 		return;
-	if (magic_sections != NULL)
-		magic_free_sections(magic_sections);
+	(void)pthread_rwlock_wrlock(&order_lock);
+	magic_free_sections();
+	magic_free_groups();
+	magic_free_data();
+	adapt_interval = adapt_count = 0;
+	(void)pthread_rwlock_unlock(&order_lock);
 	free_buffer();
 	init = 0;
 }
 
+/*
+ * Return the number of bytes allocated for the magic sections, their
+ * counters, test order, records and values, and the adaptive mode's
+ * groups.
+ */
+size_t
+magic_memory_usage(void)
+{
+	int    i;
+	size_t size;
+
+	(void)pthread_rwlock_rdlock(&order_lock);
+	size = nsections * (sizeof(magic_section_t) +
+	    sizeof(magic_counter_t) + sizeof(uint32_t)) +
+	    recsize * sizeof(magic_section_record_t) + blobsize +
+	    typesize * sizeof(uint32_t);
+	for (size += ngroups * sizeof(magic_group_t), i = 0; i < ngroups; i++)
+		size += (groups[i].nsec * groups[i].nsec + 7) / 8;
+	(void)pthread_rwlock_unlock(&order_lock);
+
+	return (size);
+}
@@ -26,8 +26,42 @@
 #define _MAGIC_H_
 #define PATH_MAGIC "mime/magic"
 
-extern int	  magic_init(const char *);
+/*
+ * Read at least this many bytes, even if the magic rules need less, so
+ * that there's something to look at for the text heuristic.
+ */
+#define MAGIC_MIN_PREFIX 512
+
+/*
+ * Records which need more than this many bytes of a file are ignored,
+ * so that a broken magic file can't make every lookup read megabytes.
+ */
+#define MAGIC_MAX_EXTENT (1 << 20)
+
+#define MAGIC_NOMATCH	 0
+#define MAGIC_MATCH	 1
+#define MAGIC_UNDECIDED	 2
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "dsbmime.h"
+
+extern int	  magic_init(char *const *, int);
+extern bool	  magic_has_rules(const char *);
+extern int	  magic_match_all(const u_char *, size_t, dsbmime_candidate_t *,
+		    int);
+extern int	  magic_match_partial(const u_char *, size_t, const char **);
+extern int	  magic_nsections(void);
+extern int	  magic_open(const char *);
+extern int	  magic_set_adaptive(u_int);
+extern int	  magic_save_order(const char *);
+extern int	  magic_load_order(const char *);
 extern void	  magic_cleanup(void);
+extern ssize_t	  magic_gen_sample(int, u_char *, size_t, const char **);
+extern size_t	  magic_prefix_size(void);
+extern size_t	  magic_memory_usage(void);
+extern ssize_t	  magic_read_prefix(const char *, int, u_char **, size_t);
+extern const char *magic_match_buffer(const u_char *, size_t);
 extern const char *magic_lookup_mime_type(const char *);
 
 #endif	/* !_MAGIC_H_ */
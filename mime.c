@@ -31,33 +31,96 @@
 #include <sys/stat.h>
 #include <err.h>
 #include <pwd.h>
+#include <stdbool.h>
 
+#include "dsbmime.h"
 #include "glob.h"
+#include "hier.h"
+#include "inode.h"
+#include "io.h"
 #include "magic.h"
+#include "text.h"
+#include "zip.h"
+#include "stats.h"
 
-static int init = 0;
+/* Maximum number of candidates per source. */
+#define MAX_CANDIDATES 32
 
-int
-dsbmime_init(void)
+/* A file whose content dsbmime_get_types() needs to read. */
+typedef struct pending_s {
+	int	   idx;
+	int	   fd;		/* Descriptor opened by io_prefetch(), or -1 */
+	int	   error;	/* errno of a failed io_prefetch(), or 0 */
+	bool	   verify;
+	const char *glob;
+} pending_t;
+
+static int    init = 0;
+static int    policy = 0;
+static size_t policy_budget = 0;
+
+static char *
+mkpath(const char *base, const char *file)
 {
-	int	      i, n;
-	char	      *path, *base[2] = { NULL };
-	bool	      have_globs, have_magic;
-	struct stat   sb;
-	struct passwd *pw;
+	char *path;
 
-	if (init != 0)
+	if ((path = malloc(strlen(base) + strlen(file) + 2)) == NULL)
+		return (NULL);
+	(void)sprintf(path, "%s/%s", base, file);
+	return (path);
+}
+
+static void
+free_paths(char **paths, int n)
+{
+	while (n-- > 0)
+		free(paths[n]);
+	free(paths);
+}
+
+/*
+ * Add the directory to the list, unless it's already there.
+ */
+static int
+add_data_dir(char **dirs, int n, const char *dir, size_t len)
+{
+	int i;
+
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+	if (len == 0)
+		return (n);
+	for (i = 0; i < n; i++)
+		if (strncmp(dirs[i], dir, len) == 0 && dirs[i][len] == '\0')
+			return (n);
+	if ((dirs[n] = strndup(dir, len)) == NULL)
 		return (-1);
-	n = 0;
-	have_globs = have_magic = false;
+	return (n + 1);
+}
+
+/*
+ * Get the data directories ordered by precedence: XDG_DATA_HOME, the
+ * directories in XDG_DATA_DIRS, and PATH_MIMEPREFIX.
+ */
+static int
+get_data_dirs(char ***dirs)
+{
+	int	      n;
+	char	      *home;
+	const char    *p, *q, *datadirs;
+	struct passwd *pw;
 
-	if ((base[n++] = strdup(PATH_MIMEPREFIX)) == NULL) {
-		if (base[0] != NULL)
-			free(base[0]);
+	if ((datadirs = getenv("XDG_DATA_DIRS")) == NULL || *datadirs == '\0')
+		datadirs = "/usr/local/share:/usr/share";
+	/* There can't be more directories than colons + 3. */
+	for (n = 3, p = datadirs; *p != '\0'; p++)
+		if (*p == ':')
+			n++;
+	if ((*dirs = malloc(sizeof(char *) * n)) == NULL)
 		return (-1);
-	}
-	base[n] = getenv("XDG_DATA_HOME");
-	if (base[n] == NULL) {
+	if ((p = getenv("XDG_DATA_HOME")) != NULL && *p != '\0')
+		n = add_data_dir(*dirs, 0, p, strlen(p));
+	else {
 		if ((pw = getpwuid(getuid())) == NULL) {
 			if (errno != 0)
 				warn("%s: getpwuid()", LIBNAME);
@@ -65,75 +128,536 @@ dsbmime_init(void)
 				warnx("%s: Couldn't find you in /etc/passwd.",
 				    LIBNAME);
 			}
+			free(*dirs);
 			return (-1);
 		}
 		endpwent();
-		base[n] = malloc(strlen(pw->pw_dir) +
-		    strlen(".local/share") + 2);
-		if (base[n] == NULL)
+		if ((home = mkpath(pw->pw_dir, ".local/share")) == NULL) {
+			free(*dirs);
 			return (-1);
-		(void)sprintf(base[n++], "%s/.local/share", pw->pw_dir);
-	} else {
-		if ((base[n] = strdup(base[n])) == NULL)
-			return (-1);
-		n++;
+		}
+		n = add_data_dir(*dirs, 0, home, strlen(home));
+		free(home);
 	}
-	for (i = 0; i < n && init < 2; i++) {
-		path = malloc(strlen(base[i]) + strlen(PATH_GLOBS) + 2);
-		if (path == NULL)
+	for (p = datadirs; n != -1; p = q + 1) {
+		if ((q = strchr(p, ':')) == NULL)
+			q = strchr(p, '\0');
+		n = add_data_dir(*dirs, n, p, q - p);
+		if (*q == '\0')
+			break;
+	}
+	if (n != -1) {
+		n = add_data_dir(*dirs, n, PATH_MIMEPREFIX,
+		    strlen(PATH_MIMEPREFIX));
+	}
+	if (n == -1)
+		free(*dirs);
+	return (n);
+}
+
+/*
+ * Get the paths of the given file in the data directories. If "exist"
+ * is true, only include existing files.
+ */
+static int
+get_paths(char **dirs, int ndirs, const char *file, bool exist, char ***paths)
+{
+	int	    i, n;
+	struct stat sb;
+
+	if ((*paths = malloc(sizeof(char *) * (ndirs + 1))) == NULL)
+		return (-1);
+	for (i = n = 0; i < ndirs; i++) {
+		if (((*paths)[n] = mkpath(dirs[i], file)) == NULL) {
+			free_paths(*paths, n);
+			*paths = NULL;
 			return (-1);
-		(void)sprintf(path, "%s/%s", base[i], PATH_GLOBS);
-		if (stat(path, &sb) == -1) {
-			if (errno != ENOENT)
-				warn("stat(%s)", path);
-		} else if (glob_init(path) == -1) {
-			free(path); return (-1);
-		} else {
-			init++;
-			have_globs = true;
 		}
-		free(path);
-		path = malloc(strlen(base[i]) + strlen(PATH_MAGIC) + 2);
-		if (path == NULL)
-			return (-1);
-		(void)sprintf(path, "%s/%s", base[i], PATH_MAGIC);
-		if (stat(path, &sb) == -1) {
+		if (!exist || stat((*paths)[n], &sb) == 0)
+			n++;
+		else {
 			if (errno != ENOENT)
-				warn("%s: stat(%s)", LIBNAME, path);
-		} else if (magic_init(path) == -1) {
-			free(path); return (-1);
-		} else {
-			init++;
-			have_magic = true;
+				warn("%s: stat(%s)", LIBNAME, (*paths)[n]);
+			free((*paths)[n]);
 		}
-		free(path);
 	}
-	for (i = 0; i < n; i++)
-		free(base[i]);
-	if (!have_globs) {
+	return (n);
+}
+
+int
+dsbmime_init(void)
+{
+	int  ndirs, nglobs, nmagic, nhier;
+	char **dirs, **globs, **magic, **subclasses, **aliases;
+
+	if (init != 0)
+		return (-1);
+	if ((ndirs = get_data_dirs(&dirs)) == -1)
+		return (-1);
+	globs = magic = subclasses = aliases = NULL;
+	nglobs = nmagic = 0;
+	if ((nglobs = get_paths(dirs, ndirs, PATH_GLOBS, true, &globs)) == -1 ||
+	    (nmagic = get_paths(dirs, ndirs, PATH_MAGIC, true, &magic)) == -1 ||
+	    (nhier = get_paths(dirs, ndirs, PATH_SUBCLASSES, false,
+	    &subclasses)) == -1 ||
+	    get_paths(dirs, ndirs, PATH_ALIASES, false, &aliases) == -1) {
+		free_paths(dirs, ndirs);
+		if (globs != NULL)
+			free_paths(globs, nglobs);
+		if (magic != NULL)
+			free_paths(magic, nmagic);
+		if (subclasses != NULL)
+			free_paths(subclasses, ndirs);
+		return (-1);
+	}
+	if (nglobs == 0) {
 		warnx("%s: Could not find globs file (%s)", LIBNAME,
 		    PATH_GLOBS);
 	}
-	if (!have_magic) {
+	if (nmagic == 0) {
 		warnx("%s: Could not find magic file (%s)", LIBNAME,
 		    PATH_MAGIC);
 	}
+	if ((nglobs == 0 && nmagic == 0) ||
+	    (nglobs > 0 && glob_init(globs, nglobs) == -1) ||
+	    (nmagic > 0 && magic_init(magic, nmagic) == -1) ||
+	    hier_init(subclasses, aliases, nhier) == -1) {
+		glob_cleanup();
+		magic_cleanup();
+	} else
+		init = 1;
+	free_paths(dirs, ndirs); free_paths(globs, nglobs);
+	free_paths(magic, nmagic); free_paths(subclasses, nhier);
+	free_paths(aliases, nhier);
+
+	return (init != 0 ? 0 : -1);
+}
+
+/*
+ * Look up the given prefix of the file in the magic file. The type of
+ * archives the magic file only knows as application/zip is determined
+ * by their content, which is read from fd.
+ */
+static const char *
+match_content(int fd, const u_char *prefix, size_t len, size_t budget)
+{
+	const char *mime, *zip;
+
+	if ((mime = magic_match_buffer(prefix, len)) != NULL &&
+	    strcmp(mime, MIME_TYPE_ZIP) == 0 &&
+	    (zip = zip_guess_mime_type(fd, prefix, len, budget)) != NULL)
+		mime = zip;
+	return (mime);
+}
+
+/*
+ * Return the type the name's type is checked against.
+ */
+static const char *
+verify_type(int fd, const u_char *prefix, size_t len, size_t budget)
+{
+	const char *mime;
+
+	/*
+	 * Rules for the name's type that don't match don't prove the name
+	 * wrong, since the rules rarely cover every variant of a format.
+	 * Without a magic match, only the text check can contradict it.
+	 */
+	if ((mime = match_content(fd, prefix, len, budget)) == NULL)
+		mime = text_guess_mime_type(prefix, len);
+	return (mime);
+}
+
+/*
+ * Decide between the type found by the name and the type found by the
+ * content. The name's type is kept if the content doesn't contradict it.
+ */
+static const char *
+verify_glob(const char *glob, int fd, const u_char *prefix, size_t len,
+    size_t budget)
+{
+	const char *mime;
+
+	mime = verify_type(fd, prefix, len, budget);
+	return (hier_is_a(glob, mime) ? glob : mime);
+}
+
+/*
+ * Look up the file's type without reading its content. Return the type
+ * if it's final. Else return NULL, and set *glob to the type found by
+ * the name, if any, which must be checked against the content if
+ * *verify is set.
+ */
+static const char *
+lookup_name(const char *filename, int flags, const char **glob, bool *verify)
+{
+	int	   weight;
+	const char *mime;
+
+	*glob = NULL;
+	*verify = false;
+	/* stat() is already too much I/O for glob only lookups. */
+	if (!(flags & DSBMIME_POLICY_GLOB_ONLY) &&
+	    (mime = inode_lookup_mime_type(filename)) != NULL)
+		return (mime);
+	if (!(flags & DSBMIME_POLICY_MAGIC_ONLY) &&
+	    (*glob = glob_lookup_mime_type(filename, false, &weight)) == NULL)
+		*glob = glob_lookup_mime_type(filename, true, &weight);
+	/*
+	 * A name's type only needs to be verified if its pattern has a
+	 * low weight, or if the content could prove it wrong.
+	 */
+	*verify = *glob != NULL && (flags & DSBMIME_POLICY_VERIFY_GLOB) &&
+	    (weight < GLOB_DEFAULT_WEIGHT || magic_has_rules(*glob));
+	if ((flags & DSBMIME_POLICY_GLOB_ONLY) || !*verify)
+		return (*glob);
+	return (NULL);
+}
+
+/*
+ * Look up the file's type by its content, and verify glob if verify is
+ * set. fd is the file's descriptor if it's open already, else -1. It is
+ * closed in either case.
+ */
+static const char *
+lookup_content(const char *filename, int fd, const char *glob, bool verify,
+    size_t budget)
+{
+	u_char	   *prefix;
+	ssize_t	   len;
+	const char *mime;
+
+	if (fd == -1 && (fd = magic_open(filename)) == -1)
+		return (NULL);
+	if ((len = magic_read_prefix(filename, fd, &prefix, budget)) == -1) {
+		io_close(fd);
+		return (NULL);
+	}
+	if (verify)
+		mime = verify_glob(glob, fd, prefix, len, budget);
+	/* Use the prefix read for the magic stage for both. */
+	else if ((mime = match_content(fd, prefix, len, budget)) == NULL)
+		mime = text_guess_mime_type(prefix, len);
+	io_close(fd);
+	free(prefix);
+
+	return (mime);
+}
+
+static bool
+content_needed(const char *mime, int flags)
+{
+	return (mime == NULL && !(flags & DSBMIME_POLICY_GLOB_ONLY));
+}
+
+const char *
+dsbmime_get_type_policy(const char *filename, int flags, size_t budget)
+{
+	bool	   verify;
+	const char *mime, *glob;
+
+	if (init == 0)
+		return (NULL);
+	if ((flags & DSBMIME_POLICY_GLOB_ONLY) && (flags &
+	    (DSBMIME_POLICY_MAGIC_ONLY | DSBMIME_POLICY_VERIFY_GLOB))) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	mime = lookup_name(filename, flags, &glob, &verify);
+	if (content_needed(mime, flags))
+		mime = lookup_content(filename, -1, glob, verify, budget);
+	STATS_INC(lookups);
+	if (mime == NULL)
+		STATS_INC(misses);
+	return (mime);
+}
+
+/*
+ * Open and prefetch the pending file. If that fails, keep the error, so
+ * that the file isn't opened again, and the failure is reported once.
+ */
+static void
+prefetch(pending_t *pp, const char *const *files, size_t size)
+{
+	if ((pp->fd = io_prefetch(files[pp->idx], size)) != -1) {
+		STATS_INC(magic_opens);
+		return;
+	}
+	pp->error = errno;
+	warn("%s: open(%s)", LIBNAME, files[pp->idx]);
+}
+
+int
+dsbmime_get_types(const char *const *files, int n, const char **types,
+    int *errors)
+{
+	int	  i, j, k, npending, found;
+	size_t	  size;
+	pending_t *pending;
+
 	if (init == 0)
 		return (-1);
-	return (0);
+	if (n < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (n == 0)
+		return (0);
+	if ((pending = malloc(n * sizeof(pending_t))) == NULL)
+		return (-1);
+	/*
+	 * Look up all names first, so that we know which files need to be
+	 * read, and can prefetch them.
+	 */
+	for (i = npending = found = 0; i < n; i++) {
+		errno = 0;
+		types[i] = lookup_name(files[i], policy,
+		    &pending[npending].glob, &pending[npending].verify);
+		if (content_needed(types[i], policy)) {
+			pending[npending].fd = -1;
+			pending[npending].error = 0;
+			pending[npending++].idx = i;
+			continue;
+		}
+		if (errors != NULL)
+			errors[i] = types[i] != NULL ? 0 : errno;
+	}
+	k = io_prefetch_depth();
+	size = magic_prefix_size();
+	if (policy_budget > 0 && policy_budget < size)
+		size = policy_budget;
+	/*
+	 * Keep the descriptors of the prefetched files open, and read the
+	 * content from them, so that every file is opened once.
+	 */
+	for (j = 0; j < k && j < npending; j++)
+		prefetch(&pending[j], files, size);
+	for (j = 0; j < npending; j++) {
+		if (k > 0 && j + k < npending)
+			prefetch(&pending[j + k], files, size);
+		i = pending[j].idx;
+		if ((errno = pending[j].error) != 0)
+			types[i] = NULL;
+		else {
+			types[i] = lookup_content(files[i], pending[j].fd,
+			    pending[j].glob, pending[j].verify,
+			    policy_budget);
+		}
+		if (errors != NULL)
+			errors[i] = types[i] != NULL ? 0 : errno;
+	}
+	for (i = 0; i < n; i++) {
+		STATS_INC(lookups);
+		if (types[i] != NULL)
+			found++;
+		else
+			STATS_INC(misses);
+	}
+	free(pending);
+
+	return (found);
 }
 
 const char *
 dsbmime_get_type(const char *filename)
 {
+	return (dsbmime_get_type_policy(filename, policy, policy_budget));
+}
+
+int
+dsbmime_set_io(const dsbmime_io_t *conf)
+{
+	return (io_configure(conf));
+}
+
+int
+dsbmime_set_policy(int flags, size_t budget)
+{
+	if ((flags & DSBMIME_POLICY_GLOB_ONLY) && (flags &
+	    (DSBMIME_POLICY_MAGIC_ONLY | DSBMIME_POLICY_VERIFY_GLOB))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	policy = flags;
+	policy_budget = budget;
+
+	return (0);
+}
+
+/*
+ * Add the candidate to the list of n candidates, unless the list has the
+ * same type with an equal or higher score already. Return the new length
+ * of the list.
+ */
+static int
+add_candidate(dsbmime_candidate_t *list, int n, const dsbmime_candidate_t *cp)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (strcmp(list[i].type, cp->type) != 0)
+			continue;
+		if (cp->score > list[i].score)
+			list[i] = *cp;
+		return (n);
+	}
+	list[n] = *cp;
+
+	return (n + 1);
+}
+
+/*
+ * Remove the nc candidates found by the name which the content
+ * contradicts, like dsbmime_get_type() does with VERIFY_GLOB, and
+ * return the number of remaining candidates.
+ */
+static int
+verify_candidates(dsbmime_candidate_t *cand, int nc, int fd,
+    const u_char *prefix, size_t len)
+{
+	int	   i, j;
 	const char *mime;
 
+	for (mime = NULL, i = j = 0; i < nc; i++) {
+		if (cand[i].score < GLOB_DEFAULT_WEIGHT ||
+		    magic_has_rules(cand[i].type)) {
+			if (mime == NULL)
+				mime = verify_type(fd, prefix, len,
+				    policy_budget);
+			if (!hier_is_a(cand[i].type, mime))
+				continue;
+		}
+		cand[j++] = cand[i];
+	}
+	return (j);
+}
+
+int
+dsbmime_get_candidates(const char *filename, dsbmime_candidate_t *out, int n)
+{
+	int		    i, j, fd, nc, nmagic;
+	u_char		    *prefix;
+	ssize_t		    len;
+	dsbmime_candidate_t c, cand[2 * MAX_CANDIDATES + 2];
+
+	if (init == 0)
+		return (-1);
+	STATS_INC(lookups);
+	if (!(policy & DSBMIME_POLICY_GLOB_ONLY) &&
+	    (cand[0].type = inode_lookup_mime_type(filename)) != NULL) {
+		cand[0].source = DSBMIME_SOURCE_INODE;
+		cand[0].score  = 100;
+		nc = 1;
+	} else {
+		nc = 0; fd = -1; len = -1;
+		if (!(policy & DSBMIME_POLICY_MAGIC_ONLY))
+			nc = glob_lookup_all(filename, cand, MAX_CANDIDATES);
+		if (!(policy & DSBMIME_POLICY_GLOB_ONLY) &&
+		    (fd = magic_open(filename)) != -1) {
+			len = magic_read_prefix(filename, fd, &prefix,
+			    policy_budget);
+		}
+		if (len == -1 && nc == 0) {
+			if (fd != -1)
+				io_close(fd);
+			STATS_INC(misses);
+			return (-1);
+		}
+		if (len != -1) {
+			if (policy & DSBMIME_POLICY_VERIFY_GLOB)
+				nc = verify_candidates(cand, nc, fd, prefix,
+				    len);
+			nmagic = magic_match_all(prefix, len, cand + nc,
+			    MAX_CANDIDATES);
+			for (i = nc, nc += nmagic; i < nc; i++) {
+				if (strcmp(cand[i].type, MIME_TYPE_ZIP) == 0)
+					break;
+			}
+			if (i < nc && (c.type = zip_guess_mime_type(fd,
+			    prefix, len, policy_budget)) != NULL) {
+				c.source = DSBMIME_SOURCE_CONTAINER;
+				c.score	 = 100;
+				cand[nc++] = c;
+			}
+			cand[nc].type = text_looks_like_text(prefix, len) ?
+			    MIME_TYPE_TEXT : MIME_TYPE_BINARY;
+			cand[nc].source = DSBMIME_SOURCE_TEXT;
+			cand[nc++].score = 0;
+			free(prefix);
+		}
+		if (fd != -1)
+			io_close(fd);
+	}
+	/* Remove duplicates, and sort by score, keeping the order of ties. */
+	for (i = j = 0; i < nc; i++)
+		j = add_candidate(cand, j, &cand[i]);
+	for (nc = j, i = 1; i < nc; i++) {
+		for (c = cand[i], j = i; j > 0 && cand[j - 1].score < c.score;
+		    j--)
+			cand[j] = cand[j - 1];
+		cand[j] = c;
+	}
+	for (i = 0; i < n && i < nc; i++)
+		out[i] = cand[i];
+	return (i);
+}
+
+int
+dsbmime_memory_usage(dsbmime_memory_t *mp)
+{
 	if (init == 0)
+		return (-1);
+	mp->globs     = glob_memory_usage();
+	mp->magic     = magic_memory_usage();
+	mp->hierarchy = hier_memory_usage();
+	mp->stats     = stats_memory_usage();
+	mp->total     = mp->globs + mp->magic + mp->hierarchy + mp->stats;
+
+	return (0);
+}
+
+int
+dsbmime_is_a(const char *type, const char *parent)
+{
+	if (type == NULL || parent == NULL) {
+		errno = EINVAL;
+		return (0);
+	}
+	return (hier_is_a(type, parent) ? 1 : 0);
+}
+
+const char *
+dsbmime_canonical(const char *type)
+{
+	if (type == NULL) {
+		errno = EINVAL;
 		return (NULL);
-	if ((mime = glob_lookup_mime_type(filename, false)) == NULL &&
-	    (mime = glob_lookup_mime_type(filename, true)) == NULL)
-		mime = magic_lookup_mime_type(filename);
-	return (mime);
+	}
+	return (hier_canonical(type));
+}
+
+int
+dsbmime_set_adaptive(unsigned int interval)
+{
+	if (init == 0)
+		return (-1);
+	return (magic_set_adaptive(interval));
+}
+
+int
+dsbmime_save_order(const char *path)
+{
+	if (init == 0)
+		return (-1);
+	return (magic_save_order(path));
+}
+
+int
+dsbmime_load_order(const char *path)
+{
+	if (init == 0)
+		return (-1);
+	return (magic_load_order(path));
 }
 
 void
@@ -143,6 +667,7 @@ dsbmime_cleanup(void)
 		return;
 	magic_cleanup();
 	glob_cleanup();
+	hier_cleanup();
 	init = 0;
 }
 
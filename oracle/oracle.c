@@ -0,0 +1,91 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The oracle of the differential fuzzer: glob.c, glob.h, magic.c and
+ * magic.h in this directory are the files of the first release, copied
+ * without any change. They are compiled here with their entry points
+ * renamed to oracle_*, so they can be linked together with the library.
+ *
+ * glob_gen_hashtbl() leaves the hashed flag of patterns not starting with
+ * "*." unset, so memory is zeroed on allocation, and oracle_magic_free()
+ * frees what magic_cleanup() forgets. Everything else is left as it was,
+ * bugs included. fuzz.c only compares the results for rules the first
+ * release reads correctly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <errno.h>
+#include <err.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#ifdef __linux__
+# include <arpa/inet.h>
+#endif
+
+#ifndef LIBNAME
+# define LIBNAME "oracle"
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+# pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+# pragma GCC diagnostic ignored "-Wstringop-overflow"
+#endif
+
+#define init			oracle_glob_initialized
+#define glob_init		oracle_glob_init
+#define glob_cleanup		oracle_glob_cleanup
+#define glob_lookup_mime_type	oracle_glob_lookup_mime_type
+#define malloc(n)		calloc(1, (n))
+#include "glob.c"
+#undef malloc
+#undef init
+
+#define init			oracle_magic_initialized
+#define magic_init		oracle_magic_init
+#define magic_cleanup		oracle_magic_cleanup
+#define magic_lookup_mime_type	oracle_magic_lookup_mime_type
+#include "magic.c"
+
+/*
+ * magic_cleanup() frees the headers and records of the sections, but not
+ * the sections.
+ */
+void
+oracle_magic_free(void)
+{
+	magic_section_t *sec, *next;
+
+	sec = init != 0 ? magic_sections : NULL;
+	magic_cleanup();
+	for (; sec != NULL; sec = next) {
+		next = sec->next;
+		free(sec);
+	}
+}
@@ -0,0 +1,207 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "stats.h"
+
+#if DSBMIME_STATS
+/*
+ * Every thread gets its own counter block, so the hot path only ever
+ * writes to thread local memory. The blocks are chained into a list in
+ * order to be able to sum them up in dsbmime_get_stats(). When a thread
+ * terminates, its counters are folded into the "retired" block.
+ *
+ * The counters only ever grow. dsbmime_reset_stats() doesn't write to
+ * the blocks of other threads, which may be counting at the same time,
+ * but saves the current sums in "base", which dsbmime_get_stats()
+ * subtracts.
+ */
+typedef struct stats_block_s {
+	dsbmime_stats_t	      stats;
+	struct stats_block_s *next;
+} stats_block_t;
+
+__thread dsbmime_stats_t *stats_tls = NULL;
+volatile bool		 stats_timing = false;
+
+static bool		 have_key = false;
+static stats_block_t	 *blocks = NULL;
+static pthread_key_t	 key;
+static pthread_mutex_t	 mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	 once = PTHREAD_ONCE_INIT;
+static dsbmime_stats_t	 retired;
+static dsbmime_stats_t	 base;		/* Sums at the last reset */
+/* Used if we run out of memory. Shared by all threads. */
+dsbmime_stats_t		 stats_fallback;
+
+static void
+stats_add(dsbmime_stats_t *to, const dsbmime_stats_t *from)
+{
+	int	 i;
+	uint64_t *p, *q;
+
+	/* dsbmime_stats_t consists of uint64_t only. */
+	p = (uint64_t *)to; q = (uint64_t *)from;
+	for (i = 0; i < sizeof(dsbmime_stats_t) / sizeof(uint64_t); i++)
+		p[i] += q[i];
+}
+
+/*
+ * Sum up the counters of all threads. Must be called with mtx held.
+ */
+static void
+stats_sum(dsbmime_stats_t *sp)
+{
+	int	      i;
+	uint64_t      *p, *q;
+	stats_block_t *bp;
+
+	(void)memset(sp, 0, sizeof(*sp));
+	stats_add(sp, &retired);
+	for (bp = blocks; bp != NULL; bp = bp->next)
+		stats_add(sp, &bp->stats);
+	p = (uint64_t *)sp; q = (uint64_t *)&stats_fallback;
+	for (i = 0; i < sizeof(dsbmime_stats_t) / sizeof(uint64_t); i++)
+		p[i] += __atomic_load_n(&q[i], __ATOMIC_RELAXED);
+}
+
+static void
+stats_thread_exit(void *arg)
+{
+	stats_block_t *bp, **bpp;
+
+	(void)pthread_mutex_lock(&mtx);
+	for (bpp = &blocks; (bp = *bpp) != NULL; bpp = &bp->next) {
+		if (bp == arg) {
+			*bpp = bp->next;
+			stats_add(&retired, &bp->stats);
+			free(bp);
+			break;
+		}
+	}
+	(void)pthread_mutex_unlock(&mtx);
+	stats_tls = NULL;
+}
+
+static void
+stats_create_key(void)
+{
+	if (pthread_key_create(&key, stats_thread_exit) == 0)
+		have_key = true;
+}
+
+dsbmime_stats_t *
+stats_register(void)
+{
+	stats_block_t *bp;
+
+	(void)pthread_once(&once, stats_create_key);
+	if ((bp = calloc(1, sizeof(stats_block_t))) == NULL)
+		return (stats_tls = &stats_fallback);
+	if (have_key)
+		(void)pthread_setspecific(key, bp);
+	(void)pthread_mutex_lock(&mtx);
+	bp->next = blocks; blocks = bp;
+	(void)pthread_mutex_unlock(&mtx);
+
+	return (stats_tls = &bp->stats);
+}
+
+void
+stats_record_latency(const struct timespec *start, int stage)
+{
+	int		i;
+	uint64_t	ns;
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000 +
+	    now.tv_nsec - start->tv_nsec;
+	/* Bucket i counts durations of less than 2^i nanoseconds. */
+	for (i = 0; i < DSBMIME_HIST_BUCKETS - 1 && ns != 0; i++)
+		ns >>= 1;
+	STATS_INC(latency[stage][i]);
+}
+#endif	/* DSBMIME_STATS */
+
+int
+dsbmime_get_stats(dsbmime_stats_t *sp)
+{
+#if DSBMIME_STATS
+	int	 i;
+	uint64_t *p, *q;
+
+	(void)pthread_mutex_lock(&mtx);
+	stats_sum(sp);
+	p = (uint64_t *)sp; q = (uint64_t *)&base;
+	for (i = 0; i < sizeof(dsbmime_stats_t) / sizeof(uint64_t); i++)
+		p[i] -= q[i];
+	(void)pthread_mutex_unlock(&mtx);
+	return (0);
+#else
+	(void)memset(sp, 0, sizeof(*sp));
+	errno = ENOTSUP;
+	return (-1);
+#endif
+}
+
+void
+dsbmime_reset_stats(void)
+{
+#if DSBMIME_STATS
+	(void)pthread_mutex_lock(&mtx);
+	stats_sum(&base);
+	(void)pthread_mutex_unlock(&mtx);
+#endif
+}
+
+void
+dsbmime_stats_timing(int on)
+{
+#if DSBMIME_STATS
+	stats_timing = (on != 0);
+#endif
+}
+
+/*
+ * Return the number of bytes allocated for the per-thread counters.
+ */
+size_t
+stats_memory_usage(void)
+{
+	size_t size = 0;
+#if DSBMIME_STATS
+	stats_block_t *bp;
+
+	(void)pthread_mutex_lock(&mtx);
+	for (bp = blocks; bp != NULL; bp = bp->next)
+		size += sizeof(stats_block_t);
+	(void)pthread_mutex_unlock(&mtx);
+#endif
+	return (size);
+}
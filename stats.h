@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdbool.h>
+#include <time.h>
+#include "dsbmime.h"
+
+#ifndef DSBMIME_STATS
+# define DSBMIME_STATS 0
+#endif
+
+#if DSBMIME_STATS
+extern __thread dsbmime_stats_t *stats_tls;
+extern volatile bool stats_timing;
+extern dsbmime_stats_t stats_fallback;
+
+extern dsbmime_stats_t *stats_register(void);
+extern void		stats_record_latency(const struct timespec *, int);
+
+/*
+ * The timer remembers whether timing was on when it was started, so that
+ * a call to dsbmime_stats_timing() between STATS_START() and STATS_STOP()
+ * can't record the latency of an unset start time.
+ */
+typedef struct stats_timer_s {
+	bool		on;
+	struct timespec ts;
+} stats_timer_t;
+
+# define STATS_PTR()	  (stats_tls != NULL ? stats_tls : stats_register())
+/* The fallback block is shared by all threads, so update it atomically. */
+# define STATS_INC(f)	  STATS_ADD(f, 1)
+# define STATS_ADD(f, n)  do {					\
+	dsbmime_stats_t *stats_sp = STATS_PTR();		\
+								\
+	if (stats_sp == &stats_fallback)			\
+		(void)__atomic_add_fetch(&stats_sp->f, (n),	\
+		    __ATOMIC_RELAXED);				\
+	else							\
+		stats_sp->f += (n);				\
+} while (0)
+# define STATS_TIMER(t)	  stats_timer_t t
+# define STATS_START(t)	  do {					\
+	if (((t).on = stats_timing))				\
+		(void)clock_gettime(CLOCK_MONOTONIC, &(t).ts);	\
+} while (0)
+# define STATS_STOP(t, stage) do {				\
+	if ((t).on)						\
+		stats_record_latency(&(t).ts, (stage));		\
+} while (0)
+#else
+# define STATS_INC(f)	      do { } while (0)
+# define STATS_ADD(f, n)      do { } while (0)
+# define STATS_TIMER(t)	      int t __attribute__((unused))
+# define STATS_START(t)	      do { } while (0)
+# define STATS_STOP(t, stage) do { } while (0)
+#endif	/* DSBMIME_STATS */
+
+extern size_t stats_memory_usage(void);
+
+#endif	/* !_STATS_H_ */
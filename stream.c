@@ -0,0 +1,174 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Detection for data which can't be seeked or read twice, like pipes,
+ * sockets, or decompressor output. The caller feeds the beginning of
+ * the data chunk by chunk. The chunks are collected in a buffer of the
+ * size the magic rules need at most, and after each chunk we check
+ * whether the result is already decided. The collected bytes can be
+ * taken from the buffer afterwards, so the caller doesn't need to keep
+ * a copy.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "dsbmime.h"
+#include "glob.h"
+#include "inode.h"
+#include "magic.h"
+#include "text.h"
+#include "stats.h"
+
+struct dsbmime_stream_s {
+	bool	   eof;
+	size_t	   len;
+	size_t	   size;
+	u_char	   *buf;
+	const char *mime;	/* NULL until decided */
+};
+
+/*
+ * Check whether the type is decided by the bytes collected so far.
+ */
+static int
+stream_update(dsbmime_stream_t *sp)
+{
+	const char *mime;
+
+	if (sp->mime != NULL)
+		return (1);
+	if (sp->eof && sp->len == 0)
+		mime = MIME_TYPE_ZEROSIZE;
+	else if (sp->eof || sp->len == sp->size) {
+		/* Nothing more to come. */
+		if ((mime = magic_match_buffer(sp->buf, sp->len)) == NULL)
+			mime = text_guess_mime_type(sp->buf, sp->len);
+	} else {
+		if (magic_match_partial(sp->buf, sp->len, &mime) == 0)
+			return (0);
+		if (mime == NULL) {
+			/*
+			 * No magic rule can match. Text needs the entire
+			 * prefix, but binary data can be detected early.
+			 */
+			if (sp->len < 3 ||
+			    text_looks_like_text(sp->buf, sp->len))
+				return (0);
+			STATS_INC(hits[DSBMIME_STAGE_TEXT]);
+			mime = MIME_TYPE_BINARY;
+		}
+	}
+	STATS_INC(lookups);
+	sp->mime = mime;
+
+	return (1);
+}
+
+dsbmime_stream_t *
+dsbmime_stream_open(const char *name)
+{
+	dsbmime_stream_t *sp;
+
+	if ((sp = malloc(sizeof(dsbmime_stream_t))) == NULL)
+		return (NULL);
+	sp->eof	 = false;
+	sp->len	 = 0;
+	sp->size = magic_prefix_size();
+	sp->mime = NULL;
+	if ((sp->buf = malloc(sp->size)) == NULL) {
+		free(sp);
+		return (NULL);
+	}
+	if (name != NULL &&
+	    ((sp->mime = glob_lookup_mime_type(name, false, NULL)) != NULL ||
+	    (sp->mime = glob_lookup_mime_type(name, true, NULL)) != NULL))
+		STATS_INC(lookups);
+	return (sp);
+}
+
+int
+dsbmime_stream_push(dsbmime_stream_t *sp, const void *data, size_t len)
+{
+	if (sp->mime != NULL)
+		return (1);
+	if (len > sp->size - sp->len)
+		len = sp->size - sp->len;
+	(void)memcpy(sp->buf + sp->len, data, len);
+	sp->len += len;
+
+	return (stream_update(sp));
+}
+
+int
+dsbmime_stream_read(dsbmime_stream_t *sp, int fd)
+{
+	ssize_t n;
+
+	if (sp->mime != NULL)
+		return (1);
+	if ((n = read(fd, sp->buf + sp->len, sp->size - sp->len)) == -1)
+		return (-1);
+	if (n == 0)
+		sp->eof = true;
+	sp->len += n;
+
+	return (stream_update(sp));
+}
+
+const char *
+dsbmime_stream_finish(dsbmime_stream_t *sp)
+{
+	sp->eof = true;
+	(void)stream_update(sp);
+
+	return (sp->mime);
+}
+
+const char *
+dsbmime_stream_type(const dsbmime_stream_t *sp)
+{
+	return (sp->mime);
+}
+
+const unsigned char *
+dsbmime_stream_data(const dsbmime_stream_t *sp, size_t *len)
+{
+	*len = sp->len;
+	return (sp->buf);
+}
+
+void
+dsbmime_stream_close(dsbmime_stream_t *sp)
+{
+	if (sp == NULL)
+		return;
+	free(sp->buf);
+	free(sp);
+}
@@ -0,0 +1,182 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Text/binary heuristic for files no glob or magic rule matches. As
+ * the shared-mime-info spec requires, such files are text/plain if they
+ * look like text, and application/octet-stream otherwise.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#include "text.h"
+#include "stats.h"
+
+/*
+ * Return the index of the first byte in p which is neither printable
+ * ASCII nor one of '\t', '\n', and '\r', or len if there is none.
+ */
+static size_t
+text_skip_plain(const u_char *p, size_t len)
+{
+	size_t i = 0;
+#if defined(__AVX2__)
+	int	mask;
+	__m256i v, bad, sp, nl, tab, cr;
+
+	sp  = _mm256_set1_epi8(0x20);
+	nl  = _mm256_set1_epi8('\n');
+	tab = _mm256_set1_epi8('\t');
+	cr  = _mm256_set1_epi8('\r');
+	for (; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		/* Signed compare, so bytes >= 0x80 are less than 0x20, too. */
+		bad = _mm256_cmpgt_epi8(sp, v);
+		bad = _mm256_andnot_si256(_mm256_or_si256(
+		    _mm256_cmpeq_epi8(v, nl), _mm256_or_si256(
+		    _mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, cr))),
+		    bad);
+		if ((mask = _mm256_movemask_epi8(bad)) != 0)
+			return (i + __builtin_ctz(mask));
+	}
+#elif defined(__SSE2__)
+	int	mask;
+	__m128i v, bad, sp, nl, tab, cr;
+
+	sp  = _mm_set1_epi8(0x20);
+	nl  = _mm_set1_epi8('\n');
+	tab = _mm_set1_epi8('\t');
+	cr  = _mm_set1_epi8('\r');
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		/* Signed compare, so bytes >= 0x80 are less than 0x20, too. */
+		bad = _mm_cmplt_epi8(v, sp);
+		bad = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nl),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+		    _mm_cmpeq_epi8(v, cr))), bad);
+		if ((mask = _mm_movemask_epi8(bad)) != 0)
+			return (i + __builtin_ctz(mask));
+	}
+#endif
+	for (; i < len; i++) {
+		if ((p[i] < 0x20 || p[i] >= 0x80) && p[i] != '\n' &&
+		    p[i] != '\t' && p[i] != '\r')
+			return (i);
+	}
+	return (len);
+}
+
+/*
+ * Return the length of the valid UTF-8 sequence at p, 0 if it's invalid,
+ * or -1 if it is cut off by the end of the buffer.
+ */
+static int
+text_utf8_seqlen(const u_char *p, size_t len)
+{
+	int    i, n;
+	u_char min, max;
+
+	min = 0x80; max = 0xbf;
+	if (p[0] >= 0xc2 && p[0] <= 0xdf)
+		n = 2;
+	else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+		n = 3;
+		/* Reject overlong forms and surrogates. */
+		if (p[0] == 0xe0)
+			min = 0xa0;
+		else if (p[0] == 0xed)
+			max = 0x9f;
+	} else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+		n = 4;
+		if (p[0] == 0xf0)
+			min = 0x90;
+		else if (p[0] == 0xf4)
+			max = 0x8f;
+	} else
+		return (0);
+	for (i = 1; i < n; i++, min = 0x80, max = 0xbf) {
+		if (i >= len)
+			return (-1);
+		if (p[i] < min || p[i] > max)
+			return (0);
+	}
+	return (n);
+}
+
+/*
+ * Check whether the given file prefix is text. It is if it starts with
+ * a UTF-8 or UTF-16 BOM, or if it is valid UTF-8 without control
+ * characters other than '\b', '\t', '\n', '\v', '\f', '\r', and ESC.
+ * A UTF-8 sequence cut off by the end of the prefix is accepted, since
+ * the prefix is usually shorter than the file. Hence, if a prefix of at
+ * least three bytes (the longest BOM) is not text, no longer prefix of
+ * the same file is either.
+ */
+bool
+text_looks_like_text(const u_char *p, size_t len)
+{
+	int    n;
+	size_t i;
+
+	if ((len >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0) ||
+	    (len >= 2 && (memcmp(p, "\xfe\xff", 2) == 0 ||
+	    memcmp(p, "\xff\xfe", 2) == 0)))
+		return (true);
+	for (i = 0; (i += text_skip_plain(p + i, len - i)) < len;) {
+		if (p[i] < 0x80) {
+			if (p[i] == '\b' || p[i] == '\v' || p[i] == '\f' ||
+			    p[i] == 0x1b) {
+				i++;
+				continue;
+			}
+			return (false);
+		}
+		if ((n = text_utf8_seqlen(p + i, len - i)) > 0)
+			i += n;
+		else
+			return (n == -1);
+	}
+	return (true);
+}
+
+const char *
+text_guess_mime_type(const u_char *p, size_t len)
+{
+	bool text;
+	STATS_TIMER(t);
+
+	STATS_START(t);
+	text = text_looks_like_text(p, len);
+	STATS_STOP(t, DSBMIME_STAGE_TEXT);
+	STATS_INC(hits[DSBMIME_STAGE_TEXT]);
+
+	return (text ? MIME_TYPE_TEXT : MIME_TYPE_BINARY);
+}
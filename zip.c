@@ -0,0 +1,333 @@
+/*-
+ * Copyright (c) 2016 Marcel Kaiser. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tell the types of ZIP based container formats apart, which the magic
+ * file only knows as application/zip. The type is taken from the
+ * archive's "mimetype" entry if it has one (ODF, EPUB), else from the
+ * names of its members (OOXML, JAR, APK). The names are read from the
+ * central directory at the end of the file with a few pread()s on the
+ * descriptor the prefix was read from. Together with the prefix, not
+ * more than the lookup's budget is read, and never more than ZIP_MAX_IO
+ * bytes here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "zip.h"
+#include "hier.h"
+#include "stats.h"
+#include "io.h"
+
+#define ZIP_MAX_IO	 16384	/* Bytes read per file at most */
+#define ZIP_TAIL_SIZE	 1024	/* Bytes read to find the EOCD record */
+#define ZIP_MAX_MIMETYPE 128	/* Max. length of the "mimetype" entry */
+
+#define ZIP_LFH_SIG	 0x04034b50	/* Local file header */
+#define ZIP_CDH_SIG	 0x02014b50	/* Central directory header */
+#define ZIP_EOCD_SIG	 0x06054b50	/* End of central directory */
+#define ZIP_LFH_SIZE	 30
+#define ZIP_CDH_SIZE	 46
+#define ZIP_EOCD_SIZE	 22
+
+#define MIME_TYPE_OOXML "application/vnd.openxmlformats-officedocument."
+#define MIME_TYPE_DOCX	MIME_TYPE_OOXML "wordprocessingml.document"
+#define MIME_TYPE_XLSX	MIME_TYPE_OOXML "spreadsheetml.sheet"
+#define MIME_TYPE_PPTX	MIME_TYPE_OOXML "presentationml.presentation"
+#define MIME_TYPE_EPUB	"application/epub+zip"
+#define MIME_TYPE_JAR	"application/x-java-archive"
+#define MIME_TYPE_APK	"application/vnd.android.package-archive"
+
+/* Member names which tell the type of an archive. */
+#define HAS_CONTENT_TYPES 0x001		/* [Content_Types].xml (OOXML) */
+#define HAS_WORD	  0x002		/* word/ */
+#define HAS_XL		  0x004		/* xl/ */
+#define HAS_PPT		  0x008		/* ppt/ */
+#define HAS_CONTAINER	  0x010		/* META-INF/container.xml (EPUB) */
+#define HAS_MANIFEST	  0x020		/* META-INF/MANIFEST.MF (JAR) */
+#define HAS_CLASS	  0x040		/* *.class */
+#define HAS_ANDROID	  0x080		/* AndroidManifest.xml */
+
+typedef struct zip_io_s {
+	int    fd;
+	off_t  size;		/* File size */
+	size_t budget;		/* Bytes left to read */
+} zip_io_t;
+
+static uint16_t
+get16(const u_char *p)
+{
+	return (p[0] | p[1] << 8);
+}
+
+static uint32_t
+get32(const u_char *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+/*
+ * Read up to len bytes at the given offset, but not more than the
+ * budget allows. Return the number of bytes read, or -1.
+ */
+static ssize_t
+zip_read(zip_io_t *io, u_char *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	if (len > io->budget)
+		len = io->budget;
+	if (offset >= io->size)
+		return (0);
+	if ((off_t)len > io->size - offset)
+		len = io->size - offset;
+	if ((n = io_pread(io->fd, buf, len, offset)) == -1)
+		return (-1);
+	io->budget -= n;
+	STATS_ADD(magic_bytes, n);
+
+	return (n);
+}
+
+/*
+ * Return the type named by the content of a "mimetype" entry if it is
+ * a known subclass of application/zip, else NULL.
+ */
+static const char *
+zip_check_mimetype(const u_char *data, size_t len)
+{
+	char	   buf[ZIP_MAX_MIMETYPE + 1];
+	const char *mime;
+
+	if (len == 0 || len > ZIP_MAX_MIMETYPE)
+		return (NULL);
+	(void)memcpy(buf, data, len);
+	buf[len] = '\0';
+	/* Use the hierarchy's copy of the string, which stays valid. */
+	if ((mime = hier_canonical(buf)) == buf ||
+	    !hier_is_a(mime, MIME_TYPE_ZIP))
+		return (NULL);
+	return (mime);
+}
+
+/*
+ * If the local file header at p is a stored "mimetype" entry, return
+ * the type it names.
+ */
+static const char *
+zip_local_mimetype(const u_char *p, size_t len)
+{
+	size_t	 data;
+	uint32_t size;
+
+	if (len < ZIP_LFH_SIZE || get32(p) != ZIP_LFH_SIG)
+		return (NULL);
+	/* Must be stored, not compressed. */
+	if (get16(p + 8) != 0 || get16(p + 26) != 8 ||
+	    len < ZIP_LFH_SIZE + 8 || memcmp(p + ZIP_LFH_SIZE, "mimetype", 8))
+		return (NULL);
+	data = ZIP_LFH_SIZE + 8 + get16(p + 28);
+	size = get32(p + 18);
+	if (size > len || data > len - size)
+		return (NULL);
+	return (zip_check_mimetype(p + data, size));
+}
+
+static bool
+has_prefix(const u_char *name, size_t len, const char *prefix)
+{
+	size_t n = strlen(prefix);
+
+	return (len >= n && memcmp(name, prefix, n) == 0);
+}
+
+static bool
+has_suffix(const u_char *name, size_t len, const char *suffix)
+{
+	size_t n = strlen(suffix);
+
+	return (len >= n && memcmp(name + len - n, suffix, n) == 0);
+}
+
+/*
+ * Scan the central directory entries in buf, and return the HAS_* flags
+ * of the member names found. The offset of the local header of the
+ * "mimetype" entry is stored in mtoff, if there is one. Entries cut off
+ * by the end of buf are ignored.
+ */
+static int
+zip_scan_cdir(const u_char *buf, size_t len, off_t *mtoff)
+{
+	int	     flags;
+	size_t	     i, n;
+	const u_char *name;
+
+	for (flags = 0, i = 0; i + ZIP_CDH_SIZE <= len; i += n) {
+		if (get32(buf + i) != ZIP_CDH_SIG)
+			break;
+		n = ZIP_CDH_SIZE + get16(buf + i + 28);
+		if (i + n > len)
+			break;
+		name = buf + i + ZIP_CDH_SIZE;
+		n -= ZIP_CDH_SIZE;
+		if (n == 8 && memcmp(name, "mimetype", 8) == 0)
+			*mtoff = get32(buf + i + 42);
+		else if (n == 19 && memcmp(name, "[Content_Types].xml", n) == 0)
+			flags |= HAS_CONTENT_TYPES;
+		else if (n == 22 && memcmp(name, "META-INF/container.xml",
+		    n) == 0)
+			flags |= HAS_CONTAINER;
+		else if (n == 20 && memcmp(name, "META-INF/MANIFEST.MF",
+		    n) == 0)
+			flags |= HAS_MANIFEST;
+		else if (n == 19 && memcmp(name, "AndroidManifest.xml", n) == 0)
+			flags |= HAS_ANDROID;
+		else if (has_prefix(name, n, "word/"))
+			flags |= HAS_WORD;
+		else if (has_prefix(name, n, "xl/"))
+			flags |= HAS_XL;
+		else if (has_prefix(name, n, "ppt/"))
+			flags |= HAS_PPT;
+		else if (has_suffix(name, n, ".class"))
+			flags |= HAS_CLASS;
+		n += ZIP_CDH_SIZE + get16(buf + i + 30) + get16(buf + i + 32);
+	}
+	return (flags);
+}
+
+static const char *
+zip_type_by_members(int flags)
+{
+	if (flags & HAS_CONTENT_TYPES) {
+		if (flags & HAS_WORD)
+			return (MIME_TYPE_DOCX);
+		if (flags & HAS_XL)
+			return (MIME_TYPE_XLSX);
+		if (flags & HAS_PPT)
+			return (MIME_TYPE_PPTX);
+		return (NULL);
+	}
+	if (flags & HAS_CONTAINER)
+		return (MIME_TYPE_EPUB);
+	if (flags & HAS_ANDROID)
+		return (MIME_TYPE_APK);
+	if (flags & (HAS_MANIFEST | HAS_CLASS))
+		return (MIME_TYPE_JAR);
+	return (NULL);
+}
+
+/*
+ * Find the central directory by the EOCD record, and determine the type
+ * by its entries.
+ */
+static const char *
+zip_lookup_cdir(zip_io_t *io)
+{
+	int	     flags;
+	off_t	     tailoff, cdoff, mtoff;
+	u_char	     *buf;
+	size_t	     cdlen;
+	ssize_t	     i, n, len;
+	const char   *mime;
+	const u_char *p;
+
+	if ((buf = malloc(ZIP_MAX_IO)) == NULL)
+		return (NULL);
+	mime = NULL;
+	tailoff = io->size > ZIP_TAIL_SIZE ? io->size - ZIP_TAIL_SIZE : 0;
+	if ((len = zip_read(io, buf, ZIP_TAIL_SIZE, tailoff)) <
+	    ZIP_EOCD_SIZE)
+		goto out;
+	/* The EOCD record is followed by a comment of up to 64k. */
+	for (i = len - ZIP_EOCD_SIZE; i >= 0; i--) {
+		if (get32(buf + i) == ZIP_EOCD_SIG &&
+		    i + ZIP_EOCD_SIZE + get16(buf + i + 20) <= len)
+			break;
+	}
+	/* Not found, or multi-disk or ZIP64 archive. */
+	if (i < 0)
+		goto out;
+	p = buf + i;
+	if (get16(p + 4) != 0 || get32(p + 16) == 0xffffffff)
+		goto out;
+	cdoff = get32(p + 16);
+	cdlen = get32(p + 12);
+	if (cdoff + (off_t)cdlen > tailoff + i)
+		goto out;
+	if (cdoff >= tailoff) {
+		/* The central directory is in the tail already. */
+		(void)memmove(buf, buf + (cdoff - tailoff), cdlen);
+		n = cdlen;
+	} else if ((n = zip_read(io, buf, cdlen, cdoff)) == -1)
+		goto out;
+	mtoff = -1;
+	flags = zip_scan_cdir(buf, n, &mtoff);
+	if (mtoff >= 0 && (n = zip_read(io, buf, ZIP_LFH_SIZE + 8 +
+	    ZIP_MAX_MIMETYPE + 64, mtoff)) > 0)
+		mime = zip_local_mimetype(buf, n);
+	if (mime == NULL)
+		mime = zip_type_by_members(flags);
+out:
+	free(buf);
+	return (mime);
+}
+
+/*
+ * Return the type of the ZIP archive with the given prefix, or NULL if
+ * it's not one of the known container formats. The rest of the archive
+ * is read from fd, unless it is -1. limit is the budget of the whole
+ * lookup, of which the prefix took len bytes, or 0 for no budget.
+ */
+const char *
+zip_guess_mime_type(int fd, const u_char *prefix, size_t len, size_t limit)
+{
+	zip_io_t    io;
+	const char  *mime;
+	struct stat sb;
+	STATS_TIMER(t);
+
+	STATS_START(t);
+	if (limit == 0)
+		io.budget = ZIP_MAX_IO;
+	else
+		io.budget = limit > len ? limit - len : 0;
+	if (io.budget > ZIP_MAX_IO)
+		io.budget = ZIP_MAX_IO;
+	/* A leading "mimetype" entry is within the prefix. */
+	if ((mime = zip_local_mimetype(prefix, len)) == NULL && fd != -1 &&
+	    io.budget > 0 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		io.fd	= fd;
+		io.size = sb.st_size;
+		mime	= zip_lookup_cdir(&io);
+	}
+	STATS_STOP(t, DSBMIME_STAGE_CONTAINER);
+	if (mime != NULL)
+		STATS_INC(hits[DSBMIME_STAGE_CONTAINER]);
+	return (mime);
+}